@@ -0,0 +1,84 @@
+#ifndef  BOUNDED_QUEUE_INC
+#define  BOUNDED_QUEUE_INC
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace Sudoku {
+    /**
+    * Blocking FIFO queue with a fixed capacity; producers wait while it is full.
+    * Once closed, pushes are dropped and consumers drain what remains before receiving nothing
+    */
+    template<typename T>
+    class BoundedQueue {
+    public:
+        explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1), closed(false) {}
+
+        // Returns false if the queue was closed before item could be queued
+        bool push(T item) {
+            std::unique_lock<std::mutex> lock(itemsMutex);
+            notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+            if (closed) {
+                return false;
+            }
+            items.push_back(std::move(item));
+            lock.unlock();
+            notEmpty.notify_one();
+            return true;
+        }
+
+        // Wait for an item; returns false once the queue is closed and empty
+        bool pop(T &item) {
+            std::unique_lock<std::mutex> lock(itemsMutex);
+            notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+            if (items.empty()) {
+                return false;
+            }
+            item = std::move(items.front());
+            items.pop_front();
+            lock.unlock();
+            notFull.notify_one();
+            return true;
+        }
+
+        // Wait for at least one item and take up to maxBatch of those queued; empty once closed and drained
+        std::vector<T> popBatch(size_t maxBatch) {
+            std::vector<T> batch;
+            std::unique_lock<std::mutex> lock(itemsMutex);
+            notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+            while (!items.empty() && batch.size() < maxBatch) {
+                batch.push_back(std::move(items.front()));
+                items.pop_front();
+            }
+            lock.unlock();
+            notFull.notify_all();
+            return batch;
+        }
+
+        void close() {
+            {
+                std::lock_guard<std::mutex> lock(itemsMutex);
+                closed = true;
+            }
+            notEmpty.notify_all();
+            notFull.notify_all();
+        }
+
+        size_t size() {
+            std::lock_guard<std::mutex> lock(itemsMutex);
+            return items.size();
+        }
+
+    private:
+        size_t capacity;
+        bool closed;
+        std::deque<T> items;
+        std::mutex itemsMutex;
+        std::condition_variable notEmpty;
+        std::condition_variable notFull;
+    };
+}
+
+#endif
@@ -0,0 +1,245 @@
+#include "batch_parse.hpp"
+#include "../bounded_queue.hpp"
+#include "../detect_digits.hpp"
+#include "../parse_executor.hpp"
+#include "../sudoku_parser.hpp"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace Sudoku {
+
+    // Files read ahead of the parse workers, per worker
+    const size_t PREFETCH_PER_WORKER = 2;
+
+    struct BatchItem {
+        string file;
+        string label;
+        vector<char> image;
+        double readMs;
+        bool readOk;
+    };
+
+    struct BatchTotals {
+        size_t images;
+        size_t failures;
+        size_t labeledDigits;
+        size_t correctDigits;
+        double parseMs;
+        long long peakBytes;
+    };
+
+    static double elapsedMs(chrono::steady_clock::time_point start) {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    static bool hasImageExtension(const string &file) {
+        static const char * extensions[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tif", ".tiff" };
+        string lower = file;
+        transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        for (const char * extension : extensions) {
+            string ext(extension);
+            if (lower.size() > ext.size() && lower.compare(lower.size() - ext.size(), ext.size(), ext) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+    * List (file, label) pairs from a directory of images (unlabeled) or a manifest
+    */
+    static vector<pair<string, string> > listSources(const string &source) {
+        vector<pair<string, string> > sources;
+        struct stat info;
+        if (stat(source.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+            DIR * dir = opendir(source.c_str());
+            if (dir) {
+                while (struct dirent * entry = readdir(dir)) {
+                    string name(entry->d_name);
+                    if (hasImageExtension(name)) {
+                        sources.push_back(make_pair(source + "/" + name, string()));
+                    }
+                }
+                closedir(dir);
+            }
+            sort(sources.begin(), sources.end());
+        } else {
+            for (const auto &element : parseTrainConfig(source.c_str())) {
+                sources.push_back(element);
+            }
+        }
+        return sources;
+    }
+
+    static string jsonEscape(const string &value) {
+        ostringstream escaped;
+        for (char c : value) {
+            switch (c) {
+                case '"': escaped << "\\\""; break;
+                case '\\': escaped << "\\\\"; break;
+                case '\n': escaped << "\\n"; break;
+                case '\t': escaped << "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        escaped << "\\u" << hex << setw(4) << setfill('0') << int(c);
+                    } else {
+                        escaped << c;
+                    }
+            }
+        }
+        return escaped.str();
+    }
+
+    static void readAhead(const vector<pair<string, string> > &sources, BoundedQueue<BatchItem> &queue) {
+        for (const auto &source : sources) {
+            BatchItem item;
+            item.file = source.first;
+            item.label = source.second;
+            auto start = chrono::steady_clock::now();
+            ifstream is(item.file, ifstream::binary);
+            item.image.assign(istreambuf_iterator<char>(is), istreambuf_iterator<char>());
+            item.readOk = is.good() || is.eof();
+            item.readMs = elapsedMs(start);
+            if (!queue.push(move(item))) {
+                break;
+            }
+        }
+        queue.close();
+    }
+
+    static void parseItems(BoundedQueue<BatchItem> &queue, const ParseContext &context, ostream &out, mutex &outMutex, BatchTotals &totals) {
+        BatchItem item;
+        while (queue.pop(item)) {
+            SudokuParseResult result;
+            memset(&result, 0, sizeof(result));
+            fill(result.gridPoints, result.gridPoints + 8, -1.0f);
+            string puzzle;
+            string error;
+            bool noGrid = false;
+
+            auto start = chrono::steady_clock::now();
+            if (!item.readOk || item.image.empty()) {
+                error = "unable to read file";
+            } else {
+                try {
+                    internalParseSudokuInto(item.image.data(), static_cast<int>(item.image.size()), &result, false, &context);
+                    puzzle = result.puzzle;
+                } catch (const NoGridError& e) {
+                    noGrid = true;
+                    error = e.what();
+                } catch (const std::exception& e) {
+                    error = e.what();
+                } catch (...) {
+                    error = "unknown exception";
+                }
+            }
+            double parseMs = elapsedMs(start);
+
+            // compare digits against the label where one is present
+            size_t labeledDigits = 0;
+            size_t correctDigits = 0;
+            if (item.label.size() == 81 && puzzle.size() == 81) {
+                for (size_t i = 0; i < 81; i++) {
+                    if (item.label[i] != '.') {
+                        labeledDigits++;
+                        correctDigits += puzzle[i] == item.label[i] ? 1 : 0;
+                    }
+                }
+            }
+
+            ostringstream line;
+            line << fixed << setprecision(3);
+            line << "{\"file\":\"" << jsonEscape(item.file) << "\"";
+            line << ",\"status\":\"" << (error.empty() ? "ok" : noGrid ? "no_grid" : "error") << "\"";
+            if (!error.empty()) {
+                line << ",\"error\":\"" << jsonEscape(error) << "\"";
+            }
+            line << ",\"puzzle\":\"" << puzzle << "\"";
+            line << ",\"gridPoints\":[";
+            for (int i = 0; i < 8; i++) {
+                line << (i > 0 ? "," : "") << result.gridPoints[i];
+            }
+            const SudokuParseTimings &timings = result.timings;
+            line << "],\"timings\":{\"readMs\":" << item.readMs << ",\"parseMs\":" << parseMs
+                 << ",\"decodeMs\":" << timings.decodeMs << ",\"detectMs\":" << timings.detectMs
+                 << ",\"classifyMs\":" << timings.classifyMs << "}";
+            line << ",\"memory\":{\"allocatedBytes\":" << result.memory.allocatedBytes
+                 << ",\"peakBytes\":" << result.memory.peakBytes << "}";
+            if (!item.label.empty()) {
+                line << ",\"label\":\"" << jsonEscape(item.label) << "\"";
+                line << ",\"exact\":" << (puzzle == item.label ? "true" : "false");
+                line << ",\"accuracy\":" << (labeledDigits > 0 ? correctDigits / double(labeledDigits) : 0.0);
+            }
+            line << "}\n";
+
+            lock_guard<mutex> lock(outMutex);
+            out << line.str() << flush;
+            totals.images++;
+            totals.failures += error.empty() ? 0 : 1;
+            totals.labeledDigits += labeledDigits;
+            totals.correctDigits += correctDigits;
+            totals.parseMs += parseMs;
+            totals.peakBytes = max(totals.peakBytes, result.memory.peakBytes);
+        }
+    }
+
+    int ParseBatch(const string &source, size_t workers, const ParseContext &context, ostream &out) {
+        vector<pair<string, string> > sources = listSources(source);
+        if (sources.empty()) {
+            cerr << "No images found in " << source << endl;
+            return 1;
+        }
+
+        // GO_SUDOKU_THREADING decides OpenCV's thread count and the default worker count
+        size_t policyWorkers = ApplyThreadingPolicy(ThreadingPolicyFromEnv());
+        workers = workers > 0 ? workers : policyWorkers;
+        BoundedQueue<BatchItem> queue(workers * PREFETCH_PER_WORKER);
+        mutex outMutex;
+        BatchTotals totals = BatchTotals();
+
+        auto start = chrono::steady_clock::now();
+        thread reader(readAhead, cref(sources), ref(queue));
+        vector<thread> pool;
+        for (size_t i = 0; i < workers; i++) {
+            pool.emplace_back(parseItems, ref(queue), cref(context), ref(out), ref(outMutex), ref(totals));
+        }
+        reader.join();
+        for (thread &worker : pool) {
+            worker.join();
+        }
+        double totalMs = elapsedMs(start);
+
+        // summary goes to stderr so the output stays one JSON object per line
+        cerr << fixed << setprecision(2)
+             << context.classifier->name() << ": "
+             << totals.images << " images in " << totalMs << " ms (" << (totals.images * 1000.0 / max(totalMs, 1.0)) << " images/s)"
+             << ", mean parse " << (totals.images > 0 ? totals.parseMs / totals.images : 0.0) << " ms"
+             << ", " << totals.failures << " failed"
+             << ", peak parse memory " << (totals.peakBytes / (1024.0 * 1024.0)) << " MiB";
+        if (totals.labeledDigits > 0) {
+            cerr << ", digit accuracy " << (100.0 * totals.correctDigits / totals.labeledDigits) << "%";
+        }
+        cerr << endl;
+
+        if (!out.flush()) {
+            cerr << "Unable to write results" << endl;
+            return 1;
+        }
+        return totals.failures > 0 ? 2 : 0;
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef  BATCH_PARSE_INC
+#define  BATCH_PARSE_INC
+
+#include <ostream>
+#include <string>
+
+#include "../sudoku_parser.hpp"
+
+namespace Sudoku {
+    /**
+    * Parse every image in a directory, or listed in a manifest shaped like train_config.csv,
+    * writing one JSON object per image to out as each completes.
+    * Files are read ahead of a pool of parse workers by a single prefetching reader.
+    * Digits are classified with the backend in context
+    */
+    int ParseBatch(const std::string &source, size_t workers, const ParseContext &context, std::ostream &out);
+}
+
+#endif
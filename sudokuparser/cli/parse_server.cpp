@@ -0,0 +1,325 @@
+#include "parse_server.hpp"
+#include "../bounded_queue.hpp"
+#include "../identify_digits.hpp"
+#include "../parse_executor.hpp"
+#include "../sudoku_parser.hpp"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace Sudoku {
+
+    // Largest encoded image accepted in a request frame
+    const uint32_t MAX_REQUEST_BYTES = 32 * 1024 * 1024;
+
+    // Requests queued per worker before connection readers are made to wait
+    const size_t REQUESTS_PER_WORKER = 8;
+
+    // Clients served at once; further connections are closed straight away
+    const size_t MAX_CONNECTIONS = 64;
+
+    // How often the accept loop checks for a shutdown signal
+    const int ACCEPT_POLL_MS = 250;
+
+    // Set by SIGINT and SIGTERM
+    static volatile sig_atomic_t stopRequested = 0;
+
+    enum ResponseStatus {
+        RESPONSE_OK = 0,
+        RESPONSE_PARSE_ERROR = 1,
+        RESPONSE_NO_GRID = 2
+    };
+
+    /**
+    * Client connection, closed once its reader has finished and every response has been written
+    */
+    struct Connection {
+        int fd;
+        mutex writeMutex;
+
+        explicit Connection(int socket) : fd(socket) {}
+        ~Connection() { close(fd); }
+    };
+
+    struct QueuedRequest {
+        shared_ptr<Connection> connection;
+        uint32_t id;
+        vector<char> image;
+    };
+
+    // Bounded queue shared by all connections; workers drain whatever has accumulated as one batch
+    typedef BoundedQueue<QueuedRequest> RequestQueue;
+
+    static bool readFully(int fd, void * buffer, size_t length) {
+        char * pos = static_cast<char *>(buffer);
+        while (length > 0) {
+            ssize_t count = read(fd, pos, length);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                return false;
+            }
+            pos += count;
+            length -= count;
+        }
+        return true;
+    }
+
+    static bool writeFully(int fd, const void * buffer, size_t length) {
+        const char * pos = static_cast<const char *>(buffer);
+        while (length > 0) {
+            ssize_t count = write(fd, pos, length);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                return false;
+            }
+            pos += count;
+            length -= count;
+        }
+        return true;
+    }
+
+    static void putUint32(vector<char> &frame, uint32_t value) {
+        uint32_t network = htonl(value);
+        const char * bytes = reinterpret_cast<const char *>(&network);
+        frame.insert(frame.end(), bytes, bytes + sizeof(network));
+    }
+
+    static void putFloat(vector<char> &frame, float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        putUint32(frame, bits);
+    }
+
+    static void writeResponse(Connection &connection, uint32_t id, uint32_t status, const SudokuParseResult &result) {
+        vector<char> body;
+        putUint32(body, id);
+        putUint32(body, status);
+        body.insert(body.end(), result.puzzle, result.puzzle + 81);
+        for (int i = 0; i < 8; i++) {
+            putFloat(body, result.gridPoints[i]);
+        }
+
+        vector<char> frame;
+        putUint32(frame, static_cast<uint32_t>(body.size()));
+        frame.insert(frame.end(), body.begin(), body.end());
+
+        lock_guard<mutex> lock(connection.writeMutex);
+        if (!writeFully(connection.fd, frame.data(), frame.size())) {
+            cerr << "Failed to write response " << id << ": " << strerror(errno) << endl;
+        }
+    }
+
+    static void readRequests(shared_ptr<Connection> connection, RequestQueue &queue) {
+        for (;;) {
+            uint32_t header[2];
+            if (!readFully(connection->fd, header, sizeof(header))) {
+                return;
+            }
+
+            QueuedRequest request;
+            request.connection = connection;
+            request.id = ntohl(header[0]);
+            uint32_t length = ntohl(header[1]);
+            if (length > MAX_REQUEST_BYTES) {
+                cerr << "Dropping connection after " << length << " byte request" << endl;
+                return;
+            }
+
+            request.image.resize(length);
+            if (!readFully(connection->fd, request.image.data(), length)) {
+                return;
+            }
+            if (!queue.push(move(request))) {
+                return;
+            }
+        }
+    }
+
+    /**
+    * Reader threads of the connected clients, bounded to MAX_CONNECTIONS
+    */
+    class ConnectionReaders {
+    public:
+        // Start reading requests from fd into queue; returns false, leaving fd to the caller, when at the limit
+        bool start(int fd, RequestQueue &queue) {
+            lock_guard<mutex> lock(readersMutex);
+            if (active.size() >= MAX_CONNECTIONS) {
+                return false;
+            }
+            shared_ptr<Connection> connection = make_shared<Connection>(fd);
+            active.insert(connection);
+            thread([this, connection, &queue]() {
+                readRequests(connection, queue);
+                finished(connection);
+            }).detach();
+            return true;
+        }
+
+        // Stop reading from every client and wait for the readers to exit; responses to requests
+        // already queued can still be written
+        void stopAll() {
+            unique_lock<mutex> lock(readersMutex);
+            for (const shared_ptr<Connection> &connection : active) {
+                shutdown(connection->fd, SHUT_RD);
+            }
+            allFinished.wait(lock, [this] { return active.empty(); });
+        }
+
+    private:
+        void finished(const shared_ptr<Connection> &connection) {
+            lock_guard<mutex> lock(readersMutex);
+            active.erase(connection);
+            if (active.empty()) {
+                allFinished.notify_all();
+            }
+        }
+
+        mutex readersMutex;
+        condition_variable allFinished;
+        set<shared_ptr<Connection> > active;
+    };
+
+    static void processBatches(RequestQueue &queue, size_t maxBatch) {
+        for (;;) {
+            vector<QueuedRequest> batch = queue.popBatch(maxBatch);
+            if (batch.empty()) {
+                return;
+            }
+
+            vector<ParseRequest> requests(batch.size());
+            vector<SudokuParseResult> results(batch.size());
+            for (size_t i = 0; i < batch.size(); i++) {
+                fill(results[i].gridPoints, results[i].gridPoints + 8, -1.0f);
+                requests[i].encodedImageData = batch[i].image.data();
+                requests[i].length = static_cast<int>(batch[i].image.size());
+                requests[i].result = &results[i];
+            }
+
+            try {
+                internalParseSudokuBatch(requests, false);
+            } catch (const std::exception& e) {
+                // failing the whole batch, say a model that cannot be loaded, must not take the server down
+                cerr << "Batch of " << batch.size() << " failed: " << e.what() << endl;
+                for (size_t i = 0; i < batch.size(); i++) {
+                    writeResponse(*batch[i].connection, batch[i].id, RESPONSE_PARSE_ERROR, results[i]);
+                }
+                continue;
+            }
+
+            for (size_t i = 0; i < batch.size(); i++) {
+                uint32_t status = IsNoGridError(requests[i].error) ? RESPONSE_NO_GRID
+                                : requests[i].error ? RESPONSE_PARSE_ERROR : RESPONSE_OK;
+                writeResponse(*batch[i].connection, batch[i].id, status, results[i]);
+            }
+        }
+    }
+
+    static void requestStop(int) {
+        stopRequested = 1;
+    }
+
+    int ServeParseRequests(const string &socketPath, size_t workers, size_t maxBatch) {
+        // a client hanging up mid-response must not terminate the server
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGINT, requestStop);
+        signal(SIGTERM, requestStop);
+
+        // load the model up front so a bad model fails fast and no request pays for loading it
+        LoadSVM();
+
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            cerr << "Socket path too long: " << socketPath << endl;
+            return 1;
+        }
+        strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) {
+            cerr << "Unable to create socket: " << strerror(errno) << endl;
+            return 1;
+        }
+        unlink(socketPath.c_str());
+        if (::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+            cerr << "Unable to listen on " << socketPath << ": " << strerror(errno) << endl;
+            close(listener);
+            return 1;
+        }
+
+        // GO_SUDOKU_THREADING decides OpenCV's thread count and the default worker count
+        size_t policyWorkers = ApplyThreadingPolicy(ThreadingPolicyFromEnv());
+        workers = workers > 0 ? workers : policyWorkers;
+        maxBatch = max<size_t>(maxBatch, 1);
+        RequestQueue queue(workers * REQUESTS_PER_WORKER);
+        vector<thread> pool;
+        for (size_t i = 0; i < workers; i++) {
+            pool.emplace_back(processBatches, ref(queue), maxBatch);
+        }
+        cout << "Serving parse requests on " << socketPath << " with " << workers << " workers, batches of up to " << maxBatch << endl;
+
+        ConnectionReaders readers;
+        int exitCode = 0;
+        while (!stopRequested) {
+            pollfd pending;
+            pending.fd = listener;
+            pending.events = POLLIN;
+            int ready = poll(&pending, 1, ACCEPT_POLL_MS);
+            if (ready <= 0) {
+                if (ready < 0 && errno != EINTR) {
+                    cerr << "poll failed: " << strerror(errno) << endl;
+                    exitCode = 1;
+                    break;
+                }
+                continue;
+            }
+
+            int fd = accept(listener, NULL, NULL);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                cerr << "accept failed: " << strerror(errno) << endl;
+                exitCode = 1;
+                break;
+            }
+            if (!readers.start(fd, queue)) {
+                cerr << "Turning away client beyond " << MAX_CONNECTIONS << " connections" << endl;
+                close(fd);
+            }
+        }
+
+        // finish the requests already read, then stop the workers
+        readers.stopAll();
+        queue.close();
+        for (thread &worker : pool) {
+            worker.join();
+        }
+        close(listener);
+        unlink(socketPath.c_str());
+        return exitCode;
+    }
+}
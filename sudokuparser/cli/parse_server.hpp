@@ -0,0 +1,21 @@
+#ifndef  PARSE_SERVER_INC
+#define  PARSE_SERVER_INC
+
+#include <string>
+
+namespace Sudoku {
+    /**
+    * Serve parse requests on a Unix domain socket with a pool of workers.
+    * Requests queued at the time a worker becomes free are parsed together as one batch.
+    * Serves up to 64 clients at once until SIGINT or SIGTERM, then answers the requests already read and returns 0.
+    *
+    * Request frame:  uint32 id, uint32 length, then length bytes of encoded image
+    * Response frame: uint32 length of the remainder, uint32 id, uint32 status (0 = parsed, 1 = failed, 2 = no grid),
+    *                 81 byte puzzle ('.' for empty cells), 8 float32 grid corner coordinates
+    *
+    * Integers and floats are big-endian.  Responses on one connection may complete out of request order
+    */
+    int ServeParseRequests(const std::string &socketPath, size_t workers, size_t maxBatch);
+}
+
+#endif
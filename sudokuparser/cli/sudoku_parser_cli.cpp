@@ -1,12 +1,20 @@
+#include <iomanip>
+#include <iterator>
+
 #include "../detect_digits.hpp"
 #include "../identify_digits.hpp"
 #include "../sudoku_parser.hpp"
+#include "batch_parse.hpp"
+#include "parse_server.hpp"
 
 using namespace std;
 using namespace Sudoku;
 
 int main(int argc, char *argv[])
 {
+  // every mode parses on threads of its own, so account memory before any of them start
+  InstallMemoryAccounting();
+
     // check if there is more than one argument and use the second one
   //  (the first argument is the executable)
   if (argc > 2)
@@ -19,6 +27,61 @@ int main(int argc, char *argv[])
 
           //cv::waitKey(0);
           return 0;
+      } else if (string(argv[1]) == "serve") {
+          // serve <socket path> [workers] [max batch]
+          size_t workers = argc > 3 ? strtoul(argv[3], NULL, 10) : 0;
+          size_t maxBatch = argc > 4 ? strtoul(argv[4], NULL, 10) : 8;
+          return ServeParseRequests(argv[2], workers, maxBatch);
+      } else if (string(argv[1]) == "parse-batch") {
+          // parse-batch <directory or manifest.csv> [workers] [output.jsonl or -] [svm|cnn|linear|centroid]
+          size_t workers = argc > 3 ? strtoul(argv[3], NULL, 10) : 0;
+          ParseContext context;
+          try {
+              context = DefaultParseContext();
+              if (argc > 5) {
+                  context.classifier = CreateDigitClassifier(argv[5], "");
+              }
+          } catch (const std::exception& e) {
+              cerr << "Unable to load classifier: " << e.what() << endl;
+              cerr << "usage: parse-batch <directory or manifest.csv> [workers] [output.jsonl or -] [svm|cnn|linear|centroid]" << endl;
+              return 1;
+          }
+          if (argc > 4 && string(argv[4]) != "-") {
+              ofstream out(argv[4]);
+              if (!out.is_open()) {
+                  cerr << "Unable to open " << argv[4] << " for writing" << endl;
+                  return 1;
+              }
+              return ParseBatch(argv[2], workers, context, out);
+          }
+          return ParseBatch(argv[2], workers, context, cout);
+      } else if (string(argv[1]) == "parse-page") {
+          // parse-page <page image>: one line of puzzle and corners per grid found
+          ifstream is(argv[2], ifstream::binary);
+          if (!is) {
+              cerr << "Unable to open " << argv[2] << endl;
+              return 1;
+          }
+          vector<char> page((istreambuf_iterator<char>(is)), istreambuf_iterator<char>());
+          if (page.empty()) {
+              cerr << "Unable to read " << argv[2] << endl;
+              return 1;
+          }
+          vector<PagePuzzle> puzzles;
+          try {
+              puzzles = internalParseSudokuPage(page.data(), static_cast<int>(page.size()));
+          } catch (const std::exception& e) {
+              cerr << "Unable to parse " << argv[2] << ": " << e.what() << endl;
+              return 1;
+          }
+          for (const PagePuzzle &puzzle : puzzles) {
+              cout << (puzzle.error ? string(81, '?') : string(puzzle.result.puzzle));
+              for (int i = 0; i < 8; i++) {
+                  cout << " " << fixed << setprecision(0) << puzzle.result.gridPoints[i];
+              }
+              cout << endl;
+          }
+          return puzzles.empty() ? 1 : 0;
       } else if (string(argv[1]) == "parse") {
           ifstream is (argv[2], std::ifstream::binary);
           if (is) {
@@ -43,14 +106,26 @@ int main(int argc, char *argv[])
                 is.close();
 
                 if (fileReadSuccessfully) {
-                    float * gridPoints;
-                    string parsed = internalParseSudoku(buffer, length, gridPoints, true);
+                    float gridPoints[8];
+                    fill(gridPoints, gridPoints + 8, -1.0f);
+                    float confidences[81];
+                    int stages[81];
+                    string parsed = internalParseSudoku(buffer, length, gridPoints, true, confidences, stages);
                     cout << parsed << endl;
+
+                    // per-cell confidence and cascade stage, useful when tuning the cascade threshold
+                    for (int row = 0; row < 9; row++) {
+                        for (int col = 0; col < 9; col++) {
+                            int i = (row * 9) + col;
+                            cout << fixed << setprecision(2) << confidences[i] << "/" << stages[i] << " ";
+                        }
+                        cout << endl;
+                    }
                 }
 
                 delete[] buffer;
 
-                if (string(argv[3]) == "wait") {
+                if (argc > 3 && string(argv[3]) == "wait") {
                     cv::waitKey(0);
                 }
           }
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <cmath>
 #include <map>
@@ -6,6 +7,9 @@
 #include <functional>
 #include <opencv2/opencv.hpp>
 
+#include "detect_digits.hpp"
+#include "logging.hpp"
+
 using namespace std;
 using namespace cv;
 RNG rng(12345);
@@ -29,14 +33,37 @@ namespace Sudoku {
     // Scale down puzzle images larger than this
     const int MAX_PUZZLE_SIZE = 900;
 
-    // Resize digits to this size when exporting to train SVM
-    const int EXPORT_DIGIT_SIZE = 28;
-
     const float MIN_GRID_PCT = 0.3;
 
+    // Largest side of the working copy of a page searched for several grids
+    const int MAX_PAGE_SIZE = 1800;
+
+    // Smallest share of a page covered by each grid in multi-grid mode
+    const float MIN_PAGE_GRID_PCT = 0.02;
+
+    // Longest to shortest side ratio of a grid candidate's bounding box
+    const float MAX_GRID_ASPECT = 1.4;
+
     const int CANNY_THRESHOLD = 65;
 
+    // Longest side of the thumbnail checked for a grid before the full parse
+    const int GRID_CHECK_SIZE = 128;
+
+    // Gradient orientation bins over 0-180 degrees; 5 degrees each
+    const int GRID_CHECK_BINS = 36;
+
+    // Gradient magnitude of a thumbnail pixel counted as an edge
+    const float GRID_EDGE_MAGNITUDE = 100.0f;
+
+    // Smallest share of thumbnail pixels on an edge; blank photos fall below this
+    const float MIN_GRID_EDGE_DENSITY = 0.02f;
+
+    // Smallest share of edge magnitude within a bin of the dominant orientation or its perpendicular;
+    // edges spread evenly over all orientations would give 6 / 36
+    const float MIN_GRID_ORIENTATION_SHARE = 0.3f;
+
     Size findCorners(vector<Point>, Point2f[]);
+    Size quadSize(const Point2f[]);
 
     /**
     * Detect numeric digits in a sudoku grid in img Mat and return Rect instances where they are found
@@ -81,23 +108,11 @@ namespace Sudoku {
     }
     
     /**
-    * Attempt to extract and warp sudoku grid
+    * Binarize the denoised image and find the outer contours grids are chosen from
     */
-    void extractGrid(const Mat& img, Mat& dst, vector<float>& gridPoints, float& scale) {
+    void findGridContours(const Mat& denoised, vector<vector<Point> >& contours, vector<Vec4i>& hierarchy) {
         Mat src_gray;
-        blur( img, src_gray, Size(3,3) );
         Mat canny_output;
-        vector<vector<Point> > contours;
-        vector<Vec4i> hierarchy;
-
-        int largest_area=0;
-        int largest_contour_index=0;
-        vector<Point> largestContour;
-        Rect bounding_rect;
-
-        Mat denoised;
-        fastNlMeansDenoising(src_gray, denoised, 10);
-
         adaptiveThreshold(~denoised, src_gray, 255, ADAPTIVE_THRESH_GAUSSIAN_C, THRESH_BINARY, 11, -2);
         #ifdef VERBOSE
         //imshow("denoised", src_gray);
@@ -108,7 +123,53 @@ namespace Sudoku {
         imwrite("artifact_02_canny.png", canny_output);
         #endif
         findContours( canny_output, contours, hierarchy, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE, Point(0, 0) );
-        Mat drawing = Mat::zeros( canny_output.size(), CV_8UC3 );
+    }
+
+    /**
+    * Warp the quadrangle at corners of src flat to a sz image and sharpen it into dst
+    */
+    void warpGrid(const Mat& src, const Point2f corners[], Size sz, Mat& dst) {
+        Point2f flatCorners[4];
+        flatCorners[0] = Point2f(0, 0);
+        flatCorners[1] = Point2f(sz.width, 0);
+        flatCorners[2] = Point2f(sz.width, sz.height);
+        flatCorners[3] = Point2f(0, sz.height);
+        Mat lambda = getPerspectiveTransform(corners, flatCorners);
+
+        Mat output;
+        warpPerspective(src, output, lambda, sz);
+
+        GaussianBlur(output, dst, Size(0, 0), 3);
+        addWeighted(output, 1.5, dst, -0.5, 0, dst);
+    }
+
+    /**
+    * Smooth and denoise a gray image into the form grids are both searched for and warped from
+    */
+    Mat denoiseGray(const Mat& img) {
+        Mat src_gray;
+        blur( img, src_gray, Size(3,3) );
+        Mat denoised;
+        fastNlMeansDenoising(src_gray, denoised, 10);
+        return denoised;
+    }
+
+    /**
+    * Attempt to extract and warp sudoku grid
+    */
+    void extractGrid(const Mat& img, Mat& dst, vector<float>& gridPoints, float& scale) {
+        vector<vector<Point> > contours;
+        vector<Vec4i> hierarchy;
+
+        int largest_area=0;
+        int largest_contour_index=0;
+        vector<Point> largestContour;
+        Rect bounding_rect;
+
+        Mat denoised = denoiseGray(img);
+
+        findGridContours(denoised, contours, hierarchy);
+        Mat drawing = Mat::zeros( denoised.size(), CV_8UC3 );
         
         for( size_t i = 0; i< contours.size(); i++ )
         {   
@@ -135,7 +196,7 @@ namespace Sudoku {
 
         float area = img.cols * img.rows;
         if (largest_area < area * MIN_GRID_PCT) {
-            cout << "largest contour area is only " << (largest_area / area) * 100 << "% of source; aborting grid extraction" << endl;
+            SUDOKU_LOG_DEBUG("largest contour too small; aborting grid extraction", {{"areaPct", (largest_area / area) * 100}});
             img.copyTo(dst);
             return;
         }
@@ -143,7 +204,6 @@ namespace Sudoku {
         // findCorners
         if (largest_contour_index < contours.size()) {
             Point2f corners[4];
-            Point2f flatCorners[4];
             Size sz = findCorners(largestContour, corners);
 
             
@@ -163,17 +223,7 @@ namespace Sudoku {
             }
             imwrite("artifact_04_quadrangle.png", drawing);
             #endif
-            flatCorners[0] = Point2f(0, 0);
-            flatCorners[1] = Point2f(sz.width, 0);
-            flatCorners[2] = Point2f(sz.width, sz.height);
-            flatCorners[3] = Point2f(0, sz.height);
-            Mat lambda = getPerspectiveTransform(corners, flatCorners);
-
-            Mat output;
-            warpPerspective(denoised, output, lambda, sz);
-
-            GaussianBlur(output, dst, Size(0, 0), 3);
-            addWeighted(output, 1.5, dst, -0.5, 0, dst);
+            warpGrid(denoised, corners, sz, dst);
             #ifdef VERBOSE
             //imshow("Warped", dst);
             imwrite("artifact_05_warped.png", dst);
@@ -225,7 +275,21 @@ namespace Sudoku {
             }
         }
 
-        // determine the dimensions that we should warp this contour to
+#ifdef VERBOSE
+        cout << "TopLeft: (" << corners[0].x << "," << corners[0].y << ")" << endl;
+        cout << "TopRight: (" << corners[1].x << "," << corners[1].y << ")" << endl;
+        cout << "BottomRight: (" << corners[2].x << "," << corners[2].y << ")" << endl;
+        cout << "BottomLeft: (" << corners[3].x << "," << corners[3].y << ")" << endl;
+#endif
+
+        return quadSize(corners);
+
+    }
+
+    /**
+    * Determine the dimensions that the quadrangle at corners should be warped to
+    */
+    Size quadSize(const Point2f corners[]) {
         float widthTop = sqrt(pow(corners[0].x - corners[1].x, 2) + pow(corners[0].y - corners[1].y, 2));
         float widthBottom = sqrt(pow(corners[2].x - corners[3].x, 2) + pow(corners[2].y - corners[3].y, 2));
 
@@ -233,17 +297,11 @@ namespace Sudoku {
         float heightRight = sqrt(pow(corners[1].x - corners[2].x, 2) + pow(corners[1].y - corners[2].y, 2));
 
 #ifdef VERBOSE
-        cout << "TopLeft: (" << corners[0].x << "," << corners[0].y << ")" << endl;
-        cout << "TopRight: (" << corners[1].x << "," << corners[1].y << ")" << endl;
-        cout << "BottomRight: (" << corners[2].x << "," << corners[2].y << ")" << endl;
-        cout << "BottomLeft: (" << corners[3].x << "," << corners[3].y << ")" << endl;
-
         cout << "widthTop: " << widthTop << endl << "widthBottom: " << widthBottom << endl;
         cout << "heightLeft: " << heightLeft << endl << "heightRight: " << heightRight << endl;
 #endif
 
         return Size(max(widthTop, widthBottom), max(heightLeft, heightRight));
-
     }
 
     /**
@@ -324,17 +382,9 @@ namespace Sudoku {
     }
 
     /**
-    * Detect Sudoku board and digits in the "raw" Mat
+    * Gray copy of src
     */
-    vector<Rect> FindDigitRects(const Mat& raw, Mat& cleaned, vector<float>& gridPoints, float &scale) {
-        // Check if image is loaded fine
-        if(!raw.data)
-            cerr << "Problem loading image!!!" << endl;
-
-        Mat src;
-        raw.copyTo(src);
-
-        // Transform source image to gray if it is not
+    static Mat toGray(const Mat& src) {
         Mat gray;
         if (src.channels() == 3)
         {
@@ -344,19 +394,13 @@ namespace Sudoku {
         {
             gray = src;
         }
-        
-        // make sure image is a reasonable size
-        if(gray.rows > MAX_PUZZLE_SIZE || gray.cols > MAX_PUZZLE_SIZE) {
-            scale = max(gray.rows, gray.cols) / float(MAX_PUZZLE_SIZE);
-            resize(gray, gray, Size(gray.cols / scale, gray.rows / scale), 0, 0, CV_INTER_AREA);
-        } else if (gray.rows < MIN_PUZZLE_SIZE || gray.cols < MIN_PUZZLE_SIZE) {
-            scale = min(gray.rows, gray.cols) / float(MAX_PUZZLE_SIZE);
-            resize(gray, gray, Size(gray.cols / scale, gray.rows / scale), 0, 0, CV_INTER_CUBIC);
-        }
+        return gray;
+    }
 
-        Mat grid = Mat::zeros( gray.size(), gray.type() );
-        extractGrid(gray, grid, gridPoints, scale);
-        
+    /**
+    * Remove the grid lines from a flattened grid and find the digits left on it
+    */
+    static vector<Rect> findGridDigits(const Mat& grid, Mat& cleaned) {
         // Apply adaptiveThreshold at the bitwise_not of gray, notice the ~ symbol
         Mat bw;
         adaptiveThreshold(~grid, bw, 255, ADAPTIVE_THRESH_GAUSSIAN_C, THRESH_BINARY, 11, -2);
@@ -383,5 +427,223 @@ namespace Sudoku {
         #endif
         return digits;
     }
-}
 
+    bool LooksLikeGrid(const Mat& gray) {
+        float shrink = max(gray.rows, gray.cols) / float(GRID_CHECK_SIZE);
+        Mat thumb;
+        if (shrink > 1.0f) {
+            resize(gray, thumb, Size(gray.cols / shrink, gray.rows / shrink), 0, 0, CV_INTER_AREA);
+        } else {
+            thumb = gray;
+        }
+
+        Mat dx, dy, magnitudes, angles;
+        Sobel(thumb, dx, CV_32F, 1, 0);
+        Sobel(thumb, dy, CV_32F, 0, 1);
+        cartToPolar(dx, dy, magnitudes, angles, true);
+
+        // histogram of edge orientation, folding opposite gradient directions together
+        float histogram[GRID_CHECK_BINS] = {0};
+        float total = 0;
+        int edges = 0;
+        for (int y = 0; y < thumb.rows; y++) {
+            const float* magnitude = magnitudes.ptr<float>(y);
+            const float* angle = angles.ptr<float>(y);
+            for (int x = 0; x < thumb.cols; x++) {
+                if (magnitude[x] < GRID_EDGE_MAGNITUDE) {
+                    continue;
+                }
+                int bin = int(fmod(angle[x], 180.0f) * GRID_CHECK_BINS / 180.0f) % GRID_CHECK_BINS;
+                histogram[bin] += magnitude[x];
+                total += magnitude[x];
+                edges++;
+            }
+        }
+
+        float density = edges / float(max(1, thumb.rows * thumb.cols));
+        if (density < MIN_GRID_EDGE_DENSITY) {
+            SUDOKU_LOG_DEBUG("grid check failed", {{"edgeDensity", density}});
+            return false;
+        }
+
+        // grid lines, even when rotated or under perspective, concentrate edges in two perpendicular orientations
+        int dominant = int(max_element(histogram, histogram + GRID_CHECK_BINS) - histogram);
+        int perpendicular = (dominant + GRID_CHECK_BINS / 2) % GRID_CHECK_BINS;
+        float aligned = 0;
+        for (int offset = -1; offset <= 1; offset++) {
+            aligned += histogram[(dominant + offset + GRID_CHECK_BINS) % GRID_CHECK_BINS];
+            aligned += histogram[(perpendicular + offset + GRID_CHECK_BINS) % GRID_CHECK_BINS];
+        }
+        float share = aligned / total;
+        if (share < MIN_GRID_ORIENTATION_SHARE) {
+            SUDOKU_LOG_DEBUG("grid check failed", {{"edgeDensity", density}, {"orientationShare", share}});
+            return false;
+        }
+        return true;
+    }
+
+    /**
+    * Detect Sudoku board and digits in the "raw" Mat
+    */
+    vector<Rect> FindDigitRects(const Mat& raw, Mat& cleaned, vector<float>& gridPoints, float &scale, const float* corners) {
+        // Check if image is loaded fine
+        if(!raw.data)
+            SUDOKU_LOG_WARN("problem loading image");
+
+        Mat src;
+        raw.copyTo(src);
+
+        // Transform source image to gray if it is not
+        Mat gray = toGray(src);
+
+        // reject photos without a grid before paying for denoising and the contour search
+        if (!corners && !LooksLikeGrid(gray)) {
+            throw NoGridError("No grid found in image");
+        }
+        
+        // make sure image is a reasonable size
+        if(gray.rows > MAX_PUZZLE_SIZE || gray.cols > MAX_PUZZLE_SIZE) {
+            scale = max(gray.rows, gray.cols) / float(MAX_PUZZLE_SIZE);
+            resize(gray, gray, Size(gray.cols / scale, gray.rows / scale), 0, 0, CV_INTER_AREA);
+        } else if (gray.rows < MIN_PUZZLE_SIZE || gray.cols < MIN_PUZZLE_SIZE) {
+            scale = min(gray.rows, gray.cols) / float(MAX_PUZZLE_SIZE);
+            resize(gray, gray, Size(gray.cols / scale, gray.rows / scale), 0, 0, CV_INTER_CUBIC);
+        }
+
+        Mat grid = Mat::zeros( gray.size(), gray.type() );
+        if (corners) {
+            // the caller already knows where the grid is, so skip the contour search but warp the
+            // same denoised image it would have so digits are found in identical input
+            Point2f quad[4];
+            for (int j = 0; j < 4; j++) {
+                quad[j] = Point2f(corners[j * 2] / scale, corners[(j * 2) + 1] / scale);
+            }
+            warpGrid(denoiseGray(gray), quad, quadSize(quad), grid);
+            gridPoints.assign(corners, corners + 8);
+        } else {
+            extractGrid(gray, grid, gridPoints, scale);
+        }
+        
+        return findGridDigits(grid, cleaned);
+    }
+
+    /**
+    * Flatten and clean each grid candidate of a page; candidates are independent so they run on OpenCV's thread pool
+    */
+    class PageGridBody : public ParallelLoopBody {
+    public:
+        PageGridBody(const Mat& gray, const vector<vector<Point2f> >& corners, vector<PageGrid>& grids)
+            : gray(gray), corners(corners), grids(grids) {}
+
+        void operator()(const Range& range) const {
+            for (int i = range.start; i < range.end; i++) {
+                const Point2f* quad = corners[i].data();
+                Size sz = quadSize(quad);
+
+                // warp straight to the working size of a single puzzle rather than resizing afterwards
+                float fit = min(1.0f, MAX_PUZZLE_SIZE / float(max(sz.width, sz.height)));
+                fit = max(fit, MIN_PUZZLE_SIZE / float(max(1, min(sz.width, sz.height))));
+                Size flat(int(sz.width * fit), int(sz.height * fit));
+
+                Mat warped;
+                warpGrid(gray, quad, flat, warped);
+                Mat denoised;
+                fastNlMeansDenoising(warped, denoised, 10);
+
+                PageGrid& grid = grids[i];
+                grid.digits = findGridDigits(denoised, grid.cleaned);
+                for (int j = 0; j < 4; j++) {
+                    grid.gridPoints.push_back(quad[j].x);
+                    grid.gridPoints.push_back(quad[j].y);
+                }
+            }
+        }
+
+    private:
+        const Mat& gray;
+        const vector<vector<Point2f> >& corners;
+        vector<PageGrid>& grids;
+    };
+
+    vector<PageGrid> FindPageGrids(const Mat& raw) {
+        vector<PageGrid> grids;
+        if(!raw.data) {
+            SUDOKU_LOG_WARN("problem loading image");
+            return grids;
+        }
+        Mat gray = toGray(raw);
+
+        // candidates are searched for on a reduced copy but warped from the full resolution page
+        float pageScale = max(1.0f, max(gray.rows, gray.cols) / float(MAX_PAGE_SIZE));
+        Mat small;
+        if (pageScale > 1.0f) {
+            resize(gray, small, Size(gray.cols / pageScale, gray.rows / pageScale), 0, 0, CV_INTER_AREA);
+        } else {
+            small = gray;
+        }
+        // a light blur stands in for the NLM denoising of a single puzzle, which is too slow at page size
+        GaussianBlur(small, small, Size(5, 5), 0);
+
+        vector<vector<Point> > contours;
+        vector<Vec4i> hierarchy;
+        findGridContours(small, contours, hierarchy);
+
+        float area = small.cols * small.rows;
+        vector<vector<Point2f> > corners;
+        for (size_t i = 0; i < contours.size(); i++) {
+            double contourSize = contourArea(contours[i], false);
+            if (contourSize < area * MIN_PAGE_GRID_PCT) {
+                continue;
+            }
+            vector<Point> approx;
+            approxPolyDP(contours[i], approx, 0.02 * arcLength(contours[i], true), true);
+            Rect bounds = boundingRect(contours[i]);
+            float aspect = max(bounds.width, bounds.height) / float(max(1, min(bounds.width, bounds.height)));
+            if (approx.size() != 4 || !isContourConvex(approx) || aspect > MAX_GRID_ASPECT) {
+                continue;
+            }
+
+            Point2f quad[4];
+            findCorners(contours[i], quad);
+            vector<Point2f> pageQuad;
+            for (int j = 0; j < 4; j++) {
+                pageQuad.push_back(quad[j] * pageScale);
+            }
+            corners.push_back(pageQuad);
+        }
+
+        // report grids top to bottom, then left to right: group quads into rows whose top edges lie
+        // within half a grid's height of the first in the row, then order each row by x
+        sort(corners.begin(), corners.end(), [](const vector<Point2f>& a, const vector<Point2f>& b) {
+            return a[0].y < b[0].y;
+        });
+        vector<vector<Point2f> > ordered;
+        for (size_t rowStart = 0; rowStart < corners.size(); ) {
+            const vector<Point2f>& first = corners[rowStart];
+            size_t rowEnd = rowStart + 1;
+            while (rowEnd < corners.size()) {
+                const vector<Point2f>& next = corners[rowEnd];
+                float tolerance = min(first[3].y - first[0].y, next[3].y - next[0].y) / 2;
+                if (next[0].y - first[0].y > tolerance) {
+                    break;
+                }
+                rowEnd++;
+            }
+            sort(corners.begin() + rowStart, corners.begin() + rowEnd, [](const vector<Point2f>& a, const vector<Point2f>& b) {
+                return a[0].x < b[0].x;
+            });
+            ordered.insert(ordered.end(), corners.begin() + rowStart, corners.begin() + rowEnd);
+            rowStart = rowEnd;
+        }
+        corners.swap(ordered);
+        SUDOKU_LOG_DEBUG("page grid candidates", {{"contours", contours.size()}, {"grids", corners.size()}});
+
+        grids.resize(corners.size());
+        parallel_for_(Range(0, static_cast<int>(corners.size())), PageGridBody(gray, corners, grids));
+
+        // a convex quad without digits is a box or frame on the page rather than a puzzle
+        grids.erase(remove_if(grids.begin(), grids.end(), [](const PageGrid& grid) { return grid.digits.empty(); }),
+                    grids.end());
+        return grids;
+    }
+}
@@ -1,6 +1,7 @@
 #ifndef  DETECT_DIGITS_INC 
 #define  DETECT_DIGITS_INC
 
+#include <stdexcept>
 #include <string>
 #include <opencv2/opencv.hpp>
 
@@ -8,8 +9,33 @@ namespace Sudoku {
     // Resize digits to this size when exporting to train SVM
     const int EXPORT_DIGIT_SIZE = 28;
 
+    // Thrown when the image fails the quick grid check and is not worth a full parse
+    class NoGridError : public std::runtime_error {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+
+    /**
+    * Quick check on a small thumbnail that img holds something grid-like: enough strong edges,
+    * concentrated in two perpendicular orientations.  Takes a few milliseconds at most
+    */
+    bool LooksLikeGrid(const cv::Mat& gray);
+
+    // A puzzle grid found on a page, flattened, with the rects of the digits on it
+    struct PageGrid {
+        cv::Mat cleaned;
+        std::vector<cv::Rect> digits;
+        std::vector<float> gridPoints;  // corners in page pixels, clockwise from top left
+    };
+
     void extractDigits(char* file);
-    std::vector<cv::Rect> FindDigitRects(const cv::Mat& img, cv::Mat& cleaned, std::vector<float>& gridPoints, float &scale);
+    // corners optionally holds the 4 grid corners in img pixels, clockwise from top left, to warp without searching for the grid
+    std::vector<cv::Rect> FindDigitRects(const cv::Mat& img, cv::Mat& cleaned, std::vector<float>& gridPoints, float &scale,
+                                         const float* corners = NULL);
+
+    // Find every roughly square quadrangle on a page large enough to be a grid and holding digits,
+    // top to bottom then left to right
+    std::vector<PageGrid> FindPageGrids(const cv::Mat& img);
 }
 
 #endif
\ No newline at end of file
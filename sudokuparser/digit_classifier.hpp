@@ -0,0 +1,89 @@
+#ifndef  DIGIT_CLASSIFIER_INC
+#define  DIGIT_CLASSIFIER_INC
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+namespace Sudoku {
+    // Environment variable naming the ONNX model used by the "cnn" backend when no path is given
+    extern const char *CNN_MODEL_ENV_VAR_NAME;
+
+    /**
+    * Classifies square digit tiles stacked vertically in a single atlas Mat.
+    * Implementations must be safe to call from several threads at once
+    */
+    class DigitClassifier {
+    public:
+        virtual ~DigitClassifier() {}
+
+        virtual std::string name() const = 0;
+
+        // Fill one digit (1-9) and confidence in [0, 1] per tile
+        virtual void classify(const cv::Mat &atlas, std::vector<int> &digits, std::vector<float> &confidences) const = 0;
+    };
+
+    /**
+    * Create a classifier backend:
+    *   "svm" - HOG features and the RBF SVM; modelPath defaults to GO_SUDOKU_SVM_MODEL
+    *   "cnn" - small CNN run through OpenCV's dnn module from an ONNX file, float or int8-quantized;
+    *           modelPath defaults to GO_SUDOKU_CNN_MODEL
+    *   "linear", "centroid" - logistic regression or nearest centroid on the HOG features, trained alongside
+    *           the SVM; a "-int16" or "-int8" suffix evaluates fixed-point weights.
+    *           modelPath defaults to LinearModelPath(GO_SUDOKU_SVM_MODEL)
+    * Throws invalid_argument for unknown backends or unreadable models
+    */
+    std::shared_ptr<const DigitClassifier> CreateDigitClassifier(const std::string &backend, const std::string &modelPath);
+
+    // A published default classifier and the generation it was published as
+    struct PublishedClassifier {
+        std::shared_ptr<const DigitClassifier> classifier;
+        unsigned long generation;
+    };
+
+    // Snapshot of the published SVM classifier, loaded from GO_SUDOKU_SVM_MODEL on first use and shared
+    // by every parse without its own backend.  Lock-free once loaded
+    PublishedClassifier PublishedDigitClassifier();
+
+    // The classifier of PublishedDigitClassifier(), for callers that need no generation
+    std::shared_ptr<const DigitClassifier> DefaultDigitClassifier();
+
+    /**
+    * Load the SVM at modelPath, or GO_SUDOKU_SVM_MODEL when empty, and publish it as the default classifier.
+    * Parses already holding the previous model finish with it, which is freed after the last of them.
+    * Returns the new generation; throws invalid_argument, leaving the current model published, when it cannot be loaded
+    */
+    unsigned long ReloadDigitClassifier(const std::string &modelPath);
+
+    // Number of default classifiers published so far; 0 before the first is loaded
+    unsigned long DigitClassifierGeneration();
+
+    std::shared_ptr<const DigitClassifier> CreateDnnDigitClassifier(const std::string &modelPath);
+    std::shared_ptr<const DigitClassifier> CreateLinearDigitClassifier(const std::string &backend, const std::string &modelPath);
+
+    /**
+    * Classify every tile with the cheap screen first and only hand tiles it scores below threshold to full
+    */
+    std::shared_ptr<const DigitClassifier> CreateScreenedDigitClassifier(std::shared_ptr<const DigitClassifier> screen,
+                                                                         std::shared_ptr<const DigitClassifier> full,
+                                                                         float threshold);
+
+    // HOG descriptors of every tile in atlas, one row per tile backed by descriptors
+    cv::Mat AtlasHOGFeatures(const cv::Mat &atlas, std::vector<float> &descriptors);
+
+    // Largest difference between AtlasHOGFeatures of the tiles of sheet and HOG computed on each tile alone
+    float AtlasHOGMismatch(const cv::Mat &sheet, int tileSize);
+
+    // File the linear and nearest-centroid models are saved to next to an SVM model
+    std::string LinearModelPath(const std::string &svmModelFile);
+
+    /**
+    * Fit one-vs-rest logistic regression and per-class centroids on the SVM's training features,
+    * log their accuracy on the test features and save both to modelFile
+    */
+    void TrainLinearModels(const cv::Mat &trainMat, const std::vector<int> &trainLabels,
+                           const cv::Mat &testMat, const std::vector<int> &testLabels, const std::string &modelFile);
+}
+
+#endif
@@ -0,0 +1,135 @@
+#include "digit_classifier.hpp"
+#include "logging.hpp"
+
+#include <cmath>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <opencv2/opencv.hpp>
+
+// The dnn module, and ONNX import in particular, is not part of every OpenCV build;
+// build with -DSUDOKU_WITH_DNN (go build -tags dnn) to enable the "cnn" backend
+#ifdef SUDOKU_WITH_DNN
+// readNetFromONNX and the ddepth argument of blobFromImages first shipped in OpenCV 3.4.3,
+// while the rest of the parser builds against 3.2
+#if CV_VERSION_MAJOR < 3 || (CV_VERSION_MAJOR == 3 && (CV_VERSION_MINOR < 4 || (CV_VERSION_MINOR == 4 && CV_VERSION_REVISION < 3)))
+#error "the cnn backend (SUDOKU_WITH_DNN, go build -tags dnn) needs OpenCV 3.4.3 or newer"
+#endif
+#include <opencv2/dnn.hpp>
+#endif
+
+using namespace cv;
+using namespace std;
+
+namespace Sudoku {
+
+    const char *CNN_MODEL_ENV_VAR_NAME = "GO_SUDOKU_CNN_MODEL";
+
+#ifdef SUDOKU_WITH_DNN
+    /**
+    * Runs an ONNX digit model taking N x 1 x 28 x 28 inputs scaled to [0, 1].
+    * The model outputs one score per class: either 10 classes indexed by digit or 9 classes for digits 1-9.
+    * Scores are softmaxed so confidence is the top class probability.
+    * dnn::Net is not re-entrant, so idle networks are pooled and a new one is read whenever all are busy
+    */
+    class DnnDigitClassifier : public DigitClassifier {
+    public:
+        explicit DnnDigitClassifier(const string &modelFile) : modelFile(modelFile) {
+            idle.push_back(readNet());
+            SUDOKU_LOG_INFO("initialized dnn digit classifier", {{"file", modelFile}});
+        }
+
+        string name() const { return "cnn"; }
+
+        void classify(const Mat &atlas, vector<int> &digits, vector<float> &confidences) const {
+            const int tileSize = atlas.cols;
+            const int count = tileSize > 0 ? atlas.rows / tileSize : 0;
+            digits.assign(count, 0);
+            confidences.assign(count, 0.0f);
+            if (count == 0) {
+                return;
+            }
+
+            // tiles are views into the atlas, so building the blob is the only copy
+            vector<Mat> tiles;
+            for (int i = 0; i < count; i++) {
+                tiles.push_back(atlas.rowRange(i * tileSize, (i + 1) * tileSize));
+            }
+            Mat blob = dnn::blobFromImages(tiles, 1.0 / 255.0, Size(tileSize, tileSize), Scalar(), false, false, CV_32F);
+
+            dnn::Net net = acquire();
+            Mat scores;
+            try {
+                net.setInput(blob);
+                scores = net.forward().reshape(1, count);
+            } catch (...) {
+                release(net);
+                throw;
+            }
+            release(net);
+
+            const int digitOffset = scores.cols == 9 ? 1 : 0;
+            for (int i = 0; i < count; i++) {
+                const float * row = scores.ptr<float>(i);
+                int best = digitOffset == 0 ? 1 : 0;  // a 10 class model never reports the unused 0 class
+                for (int c = best; c < scores.cols; c++) {
+                    if (row[c] > row[best]) {
+                        best = c;
+                    }
+                }
+                double total = 0;
+                for (int c = 0; c < scores.cols; c++) {
+                    total += exp(row[c] - row[best]);
+                }
+                digits[i] = best + digitOffset;
+                confidences[i] = float(1.0 / total);
+            }
+        }
+
+    private:
+        dnn::Net readNet() const {
+            dnn::Net net = dnn::readNetFromONNX(modelFile);
+            net.setPreferableBackend(dnn::DNN_BACKEND_OPENCV);
+            net.setPreferableTarget(dnn::DNN_TARGET_CPU);
+            return net;
+        }
+
+        dnn::Net acquire() const {
+            {
+                lock_guard<mutex> lock(idleMutex);
+                if (!idle.empty()) {
+                    dnn::Net net = idle.back();
+                    idle.pop_back();
+                    return net;
+                }
+            }
+            return readNet();
+        }
+
+        void release(const dnn::Net &net) const {
+            lock_guard<mutex> lock(idleMutex);
+            idle.push_back(net);
+        }
+
+        string modelFile;
+        mutable mutex idleMutex;
+        mutable vector<dnn::Net> idle;
+    };
+#endif
+
+    shared_ptr<const DigitClassifier> CreateDnnDigitClassifier(const string &modelPath) {
+        string modelFile = modelPath;
+        if (modelFile.empty() && getenv(CNN_MODEL_ENV_VAR_NAME)) {
+            modelFile = getenv(CNN_MODEL_ENV_VAR_NAME);
+        }
+        ifstream fs(modelFile);
+        if (!fs.good()) {
+            throw invalid_argument("Invalid model file: " + modelFile);
+        }
+#ifdef SUDOKU_WITH_DNN
+        return make_shared<DnnDigitClassifier>(modelFile);
+#else
+        throw invalid_argument("cnn backend unavailable; build with SUDOKU_WITH_DNN and OpenCV's dnn module");
+#endif
+    }
+}
@@ -1,15 +1,23 @@
 
 #include <iostream>
 #include <fstream>
+#include <cmath>
+#include <limits>
 #include <cstdlib>
 #include <iomanip> // setprecision
 #include <sstream>
+#include <memory>
+#include <mutex>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/objdetect.hpp>
 #include <opencv2/ml.hpp>
+#include <opencv2/photo.hpp>
 
+#include "digit_classifier.hpp"
+#include "identify_digits.hpp"
 #include "sudoku_parser.hpp"
+#include "logging.hpp"
 
 
 using namespace cv::ml;
@@ -40,24 +48,61 @@ namespace Sudoku {
     static string getEnvVar(string const& key)
     {
         char const* val = getenv(key.c_str()); 
-        cout << "Looking for " << key.c_str() << endl;
-        cout << "Found " << string(val) << endl;
+        SUDOKU_LOG_DEBUG("environment lookup", {{"key", key}, {"value", val}});
         
         return val == NULL ? std::string() : std::string(val);
     }
 
-    static Ptr<SVM> svmTrained;
+    // One-vs-one decision function of the SVM, cached to derive prediction confidence
+    struct PairwiseDecision {
+        double rho;
+        Mat alpha;
+        Mat svIndex;
+    };
 
-    Mat deskew(Mat& img){
+    // Scratch buffers reused across the cells of a batch
+    struct SVMScratch {
+        vector<double> kernel;
+        vector<double> decisions;
+        vector<int> votes;
+    };
+
+    /**
+    * HOG descriptors classified by the trained RBF SVM
+    */
+    class SvmDigitClassifier : public DigitClassifier {
+    public:
+        explicit SvmDigitClassifier(const string &modelFile);
+
+        string name() const { return "svm"; }
+        void classify(const Mat &atlas, vector<int> &digits, vector<float> &confidences) const;
+
+    private:
+        int predictWithConfidence(const float* sample, SVMScratch &scratch, float &confidence) const;
+
+        Ptr<SVM> svm;
+        Mat classLabels;
+        Mat supportVectors;
+        vector<PairwiseDecision> decisions;
+    };
+
+    /**
+    * Deskew img into imgOut, which may be a preallocated view such as an atlas tile
+    */
+    void deskewInto(const Mat& img, Mat& imgOut){
         Moments m = moments(img);
         if(abs(m.mu02) < 1e-2){
-            return img.clone();
+            img.copyTo(imgOut);
+            return;
         }
         float skew = m.mu11/m.mu02;
         Mat warpMat = (Mat_<float>(2,3) << 1, skew, -0.5*SZ*skew, 0, 1, 0);
-        Mat imgOut = Mat::zeros(img.rows, img.cols, img.type());
-        warpAffine(img, imgOut, warpMat, imgOut.size(),affineFlags);
+        warpAffine(img, imgOut, warpMat, img.size(),affineFlags);
+    }
 
+    Mat deskew(Mat& img){
+        Mat imgOut = Mat::zeros(img.rows, img.cols, img.type());
+        deskewInto(img, imgOut);
         return imgOut;
     } 
 
@@ -91,7 +136,7 @@ namespace Sudoku {
             }
         }
         
-        cout << "Image Count : " << ImgCount << endl;
+        SUDOKU_LOG_INFO("loaded training digits", {{"count", ImgCount}});
     }
 
     /**
@@ -156,12 +201,8 @@ namespace Sudoku {
 
     void getSVMParams(SVM *svm)
     {
-        cout << "Kernel type     : " << svm->getKernelType() << endl;
-        cout << "Type            : " << svm->getType() << endl;
-        cout << "C               : " << svm->getC() << endl;
-        cout << "Degree          : " << svm->getDegree() << endl;
-        cout << "Nu              : " << svm->getNu() << endl;
-        cout << "Gamma           : " << svm->getGamma() << endl;
+        SUDOKU_LOG_INFO("svm params", {{"kernel", svm->getKernelType()}, {"type", svm->getType()}, {"C", svm->getC()},
+                                       {"degree", svm->getDegree()}, {"nu", svm->getNu()}, {"gamma", svm->getGamma()}});
     }
 
     void SVMtrain(Mat &trainMat,vector<int> &trainLabels, Mat &testResponse,Mat &testMat){
@@ -182,7 +223,7 @@ namespace Sudoku {
 
         for(int i=0;i<testResponse.rows;i++)
         {
-            cout << testResponse.at<float>(i,0) << " " << testLabels[i] << endl;
+            SUDOKU_LOG_TRACE("svm test prediction", {{"predicted", testResponse.at<float>(i,0)}, {"label", testLabels[i]}});
             if(testResponse.at<float>(i,0) == testLabels[i]){
                 count = count + 1;
             }  
@@ -210,7 +251,7 @@ namespace Sudoku {
         CreateTrainTestHOG(trainHOG,testHOG,deskewedTrainCells,deskewedTestCells);
 
         int descriptor_size = trainHOG[0].size();
-        cout << "Descriptor Size : " << descriptor_size << endl;
+        SUDOKU_LOG_INFO("hog descriptor", {{"size", descriptor_size}});
         
         Mat trainMat(trainHOG.size(),descriptor_size,CV_32FC1);
         Mat testMat(testHOG.size(),descriptor_size,CV_32FC1);
@@ -223,6 +264,9 @@ namespace Sudoku {
         float count = 0;
         float accuracy = 0 ;
         SVMevaluate(testResponse, count, accuracy, testLabels);
+
+        // compact models for screening the easy cells ahead of the SVM
+        TrainLinearModels(trainMat, trainLabels, testMat, testLabels, LinearModelPath(getEnvVar(SVM_MODEL_ENV_VAR_NAME)));
         
         stringstream stream;
         stream << fixed << setprecision(2) << accuracy;
@@ -230,39 +274,370 @@ namespace Sudoku {
     }
 
     /**
-    * Use trained SVM to predict digit from Mat
+    * Load the pre-trained SVM along with the decision functions used to compute confidence
     */
-    int IdentifyDigit(Mat &digitMat) {
+    SvmDigitClassifier::SvmDigitClassifier(const string &modelFile) {
+        ifstream fs(modelFile);
+        if ( !fs.good()) {
+            throw invalid_argument("Invalid model file: " + modelFile);
+        }
+        svm = Algorithm::load<SVM>(modelFile);
+
+        // class labels are not exposed through the SVM API so read them from the model file
+        FileStorage modelStorage(modelFile, FileStorage::READ);
+        modelStorage["opencv_ml_svm"]["class_labels"] >> classLabels;
+        supportVectors = svm->getSupportVectors();
+
+        int classCount = classLabels.rows;
+        for (int i = 0; i < classCount * (classCount - 1) / 2; i++) {
+            PairwiseDecision df;
+            df.rho = svm->getDecisionFunction(i, df.alpha, df.svIndex);
+            decisions.push_back(df);
+        }
+        SUDOKU_LOG_INFO("initialized trained SVM", {{"file", modelFile}});
+    }
 
-        vector<float> descriptors;
+    /**
+    * Replicate the one-vs-one vote of SVM::predict for a single feature row while keeping the decision values.
+    * Confidence is the mean sigmoid margin of the winning class over each of its pairings
+    */
+    int SvmDigitClassifier::predictWithConfidence(const float* sample, SVMScratch &scratch, float &confidence) const {
+        // RBF kernel value of the sample against every support vector
+        const double gamma = svm->getGamma();
+        scratch.kernel.resize(supportVectors.rows);
+        for (int s = 0; s < supportVectors.rows; s++) {
+            const float* sv = supportVectors.ptr<float>(s);
+            double dist = 0;
+            for (int v = 0; v < supportVectors.cols; v++) {
+                double diff = sample[v] - sv[v];
+                dist += diff * diff;
+            }
+            scratch.kernel[s] = exp(-gamma * dist);
+        }
+
+        const int classCount = classLabels.rows;
+        scratch.votes.assign(classCount, 0);
+        scratch.decisions.resize(decisions.size());
+        for (int i = 0, dfi = 0; i < classCount; i++) {
+            for (int j = i + 1; j < classCount; j++, dfi++) {
+                const PairwiseDecision &df = decisions[dfi];
+                const double* alpha = df.alpha.ptr<double>(0);
+                const int* svIndex = df.svIndex.ptr<int>(0);
+                double sum = -df.rho;
+                for (size_t k = 0; k < df.alpha.total(); k++) {
+                    sum += alpha[k] * scratch.kernel[svIndex[k]];
+                }
+                scratch.decisions[dfi] = sum;
+                scratch.votes[sum > 0 ? i : j]++;
+            }
+        }
+
+        int winner = 0;
+        for (int i = 1; i < classCount; i++) {
+            if (scratch.votes[i] > scratch.votes[winner]) {
+                winner = i;
+            }
+        }
+
+        double margin = 0;
+        for (int i = 0, dfi = 0; i < classCount; i++) {
+            for (int j = i + 1; j < classCount; j++, dfi++) {
+                if (i == winner) {
+                    margin += 1.0 / (1.0 + exp(-scratch.decisions[dfi]));
+                } else if (j == winner) {
+                    margin += 1.0 / (1.0 + exp(scratch.decisions[dfi]));
+                }
+            }
+        }
+        confidence = classCount > 1 ? float(margin / (classCount - 1)) : 1.0f;
+
+        return classLabels.at<int>(winner, 0);
+    }
+
+    // Reach of the HOG gradient kernel beyond a tile
+    const int HOG_TILE_BORDER = 1;
+
+    /**
+    * HOG descriptors for all tiles of atlas are computed in one pass into descriptors,
+    * which backs the returned Mat of one row per tile.
+    * Each tile is framed by the border HOG reflects at the edge of a lone image, so gradients never
+    * reach into the neighbouring tile and features match those the model was trained on
+    */
+    Mat AtlasHOGFeatures(const Mat &atlas, vector<float> &descriptors) {
+        const int tileSize = atlas.cols;
+        const int count = tileSize > 0 ? atlas.rows / tileSize : 0;
+        descriptors.clear();
+        if (count == 0) {
+            return Mat();
+        }
+
+        const int framedSize = tileSize + 2 * HOG_TILE_BORDER;
+        Mat framed(count * framedSize, framedSize, atlas.type());
         vector<Point> positions;
+        for (int i = 0; i < count; i++) {
+            copyMakeBorder(atlas.rowRange(i * tileSize, (i + 1) * tileSize), framed.rowRange(i * framedSize, (i + 1) * framedSize),
+                           HOG_TILE_BORDER, HOG_TILE_BORDER, HOG_TILE_BORDER, HOG_TILE_BORDER, BORDER_REFLECT_101);
+            positions.push_back(Point(HOG_TILE_BORDER, i * framedSize + HOG_TILE_BORDER));
+        }
+        hog.compute(framed, descriptors, Size(), Size(), positions);
+        #ifdef VERBOSE
+        imwrite("testdigit.png", atlas);
+        #endif
+
+        const int descriptorSize = static_cast<int>(descriptors.size()) / count;
+        return Mat(count, descriptorSize, CV_32FC1, descriptors.data());
+    }
 
-        // load pre-trained SVM
-        if (!svmTrained) {
-            auto model_file = getEnvVar(SVM_MODEL_ENV_VAR_NAME);
-            ifstream fs(model_file);
-            if ( !fs.good()) {
-                throw invalid_argument("Invalid model file: " + model_file);
+    float AtlasHOGMismatch(const Mat &sheet, int tileSize) {
+        Mat atlas;
+        for (int y = 0; y + tileSize <= sheet.rows; y += tileSize) {
+            for (int x = 0; x + tileSize <= sheet.cols; x += tileSize) {
+                atlas.push_back(sheet(Rect(x, y, tileSize, tileSize)));
             }
-            svmTrained = Algorithm::load<SVM>(model_file);
-            cout << "Initialized trained SVM from " << model_file << endl;
         }
+        vector<float> descriptors;
+        Mat features = AtlasHOGFeatures(atlas, descriptors);
+
+        float mismatch = 0;
+        for (int i = 0; i < features.rows; i++) {
+            // a copy, so HOG sees the tile as a whole image rather than a view into the atlas
+            Mat tile = atlas.rowRange(i * tileSize, (i + 1) * tileSize).clone();
+            vector<float> alone;
+            hog.compute(tile, alone);
+            if (alone.size() != static_cast<size_t>(features.cols)) {
+                return numeric_limits<float>::infinity();
+            }
+            for (int j = 0; j < features.cols; j++) {
+                mismatch = max(mismatch, abs(features.at<float>(i, j) - alone[j]));
+            }
+        }
+        return mismatch;
+    }
 
-        // Get HOG descriptor
-        hog.compute(digitMat, descriptors, Size(), Size(), positions);
-        //cout << "Computed HOGDescriptor for " << digitMat.cols << "x" << digitMat.rows << " image" << endl;
-        // convert HOG descriptor to Mat
-        Mat testMat = Mat::zeros(1, descriptors.size(), CV_32FC1);
-        for (int x = 0; x < testMat.cols; x++) {
-            testMat.at<float>(0, x) = descriptors[x];
+    /**
+    * Predict each digit tile stacked vertically in atlas from a single feature buffer
+    */
+    void SvmDigitClassifier::classify(const Mat &atlas, vector<int> &digits, vector<float> &confidences) const {
+        const int tileSize = atlas.cols;
+        const int count = tileSize > 0 ? atlas.rows / tileSize : 0;
+        digits.assign(count, 0);
+        confidences.assign(count, 0.0f);
+        if (count == 0) {
+            return;
         }
 
-        // predict digit
-        Mat testResponse;
-        imwrite("testdigit.png", digitMat);
-        svmTrained->predict(testMat, testResponse);
-        //cout << "Predicted digit for " << digitMat.cols << "x" << digitMat.rows << " image" << endl;
-        // extract prediction
-        return int(testResponse.at<float>(0,0));
+        vector<float> descriptors;
+        Mat features = AtlasHOGFeatures(atlas, descriptors);
+
+        // decision values are only recoverable from uncompressed (non-linear) support vectors
+        if (classLabels.empty() || svm->getKernelType() != SVM::RBF) {
+            Mat testResponse;
+            svm->predict(features, testResponse);
+            for (int i = 0; i < count; i++) {
+                digits[i] = int(testResponse.at<float>(i, 0));
+            }
+            return;
+        }
+
+        SVMScratch scratch;
+        for (int i = 0; i < count; i++) {
+            digits[i] = predictWithConfidence(features.ptr<float>(i), scratch, confidences[i]);
+        }
+    }
+
+    /**
+    * Cheap screen over every tile with only its low-confidence tiles re-classified by the full backend
+    */
+    class ScreenedDigitClassifier : public DigitClassifier {
+    public:
+        ScreenedDigitClassifier(shared_ptr<const DigitClassifier> screen, shared_ptr<const DigitClassifier> full, float threshold)
+            : screen(screen), full(full), threshold(threshold) {}
+
+        string name() const { return screen->name() + "+" + full->name(); }
+
+        void classify(const Mat &atlas, vector<int> &digits, vector<float> &confidences) const {
+            const int tileSize = atlas.cols;
+            screen->classify(atlas, digits, confidences);
+
+            vector<int> pending;
+            for (size_t i = 0; i < digits.size(); i++) {
+                if (confidences[i] < threshold) {
+                    pending.push_back(static_cast<int>(i));
+                }
+            }
+            if (pending.empty()) {
+                return;
+            }
+
+            Mat uncertain(static_cast<int>(pending.size()) * tileSize, tileSize, atlas.type());
+            for (size_t p = 0; p < pending.size(); p++) {
+                atlas.rowRange(pending[p] * tileSize, (pending[p] + 1) * tileSize)
+                     .copyTo(uncertain.rowRange(static_cast<int>(p) * tileSize, static_cast<int>(p + 1) * tileSize));
+            }
+
+            vector<int> fullDigits;
+            vector<float> fullConfidences;
+            full->classify(uncertain, fullDigits, fullConfidences);
+            for (size_t p = 0; p < pending.size(); p++) {
+                digits[pending[p]] = fullDigits[p];
+                confidences[pending[p]] = fullConfidences[p];
+            }
+        }
+
+    private:
+        shared_ptr<const DigitClassifier> screen;
+        shared_ptr<const DigitClassifier> full;
+        float threshold;
+    };
+
+    shared_ptr<const DigitClassifier> CreateScreenedDigitClassifier(shared_ptr<const DigitClassifier> screen,
+                                                                    shared_ptr<const DigitClassifier> full,
+                                                                    float threshold) {
+        return make_shared<ScreenedDigitClassifier>(screen, full, threshold);
+    }
+
+    // Published default classifier and its generation, swapped together.  Readers only ever take a snapshot
+    // with atomic_load, so a parse keeps the model it started with while a reload swaps in its successor
+    static shared_ptr<const PublishedClassifier> published;
+    // serializes loads so concurrent first uses or reloads read the model file once each, and numbers them
+    static mutex publishMutex;
+
+    // Call with publishMutex held
+    static shared_ptr<const PublishedClassifier> publish(shared_ptr<const DigitClassifier> classifier, const string &modelFile) {
+        shared_ptr<const PublishedClassifier> previous = atomic_load(&published);
+        auto next = make_shared<PublishedClassifier>();
+        next->classifier = classifier;
+        next->generation = previous ? previous->generation + 1 : 1;
+        atomic_store(&published, shared_ptr<const PublishedClassifier>(next));
+        SUDOKU_LOG_INFO("published digit classifier", {{"file", modelFile}, {"generation", next->generation}});
+        return next;
+    }
+
+    PublishedClassifier PublishedDigitClassifier() {
+        shared_ptr<const PublishedClassifier> current = atomic_load(&published);
+        if (current) {
+            return *current;
+        }
+
+        lock_guard<mutex> lock(publishMutex);
+        current = atomic_load(&published);
+        if (!current) {
+            string modelFile = getEnvVar(SVM_MODEL_ENV_VAR_NAME);
+            current = publish(make_shared<SvmDigitClassifier>(modelFile), modelFile);
+        }
+        return *current;
+    }
+
+    shared_ptr<const DigitClassifier> DefaultDigitClassifier() {
+        return PublishedDigitClassifier().classifier;
+    }
+
+    unsigned long ReloadDigitClassifier(const string &modelPath) {
+        string modelFile = modelPath.empty() ? getEnvVar(SVM_MODEL_ENV_VAR_NAME) : modelPath;
+        lock_guard<mutex> lock(publishMutex);
+        // load before publishing so a bad model file leaves the current one in place
+        shared_ptr<const DigitClassifier> loaded = make_shared<SvmDigitClassifier>(modelFile);
+        return publish(loaded, modelFile)->generation;
+    }
+
+    unsigned long DigitClassifierGeneration() {
+        shared_ptr<const PublishedClassifier> current = atomic_load(&published);
+        return current ? current->generation : 0;
+    }
+
+    shared_ptr<const DigitClassifier> CreateDigitClassifier(const string &backend, const string &modelPath) {
+        if (backend == "svm") {
+            return modelPath.empty() ? DefaultDigitClassifier() : make_shared<SvmDigitClassifier>(modelPath);
+        } else if (backend == "cnn") {
+            return CreateDnnDigitClassifier(modelPath);
+        } else if (backend.compare(0, 6, "linear") == 0 || backend.compare(0, 8, "centroid") == 0) {
+            return CreateLinearDigitClassifier(backend, modelPath.empty() ? LinearModelPath(getEnvVar(SVM_MODEL_ENV_VAR_NAME)) : modelPath);
+        }
+        throw invalid_argument("Unknown digit classifier backend: " + backend);
+    }
+
+    /**
+    * Load the pre-trained SVM if that has not happened yet; safe to call from several threads
+    */
+    void LoadSVM() {
+        DefaultDigitClassifier();
+    }
+
+    void IdentifyDigits(const Mat &atlas, vector<int> &digits, vector<float> &confidences) {
+        DefaultDigitClassifier()->classify(atlas, digits, confidences);
+    }
+
+    /**
+    * Use trained SVM to predict digit from Mat
+    */
+    int IdentifyDigit(Mat &digitMat, float &confidence) {
+        vector<int> digits;
+        vector<float> confidences;
+        IdentifyDigits(digitMat, digits, confidences);
+        confidence = confidences[0];
+        return digits[0];
+    }
+
+    /**
+    * Classify every tile of atlas as-is first, then despeckle and finally deskew only the tiles
+    * whose confidence remains below threshold.  Each retry stage gathers its tiles into a smaller atlas.
+    * denoiseWindows holds the NLM search window for each tile since a batch may span several boards
+    */
+    void CascadeIdentifyDigits(const DigitClassifier &classifier, const Mat &atlas, const vector<int> &denoiseWindows, float threshold,
+                               vector<int> &digits, vector<float> &confidences, vector<CascadeStage> &stages) {
+        const int tileSize = atlas.cols;
+        classifier.classify(atlas, digits, confidences);
+        stages.assign(digits.size(), STAGE_FAST);
+
+        vector<int> pending;
+        for (size_t i = 0; i < digits.size(); i++) {
+            if (confidences[i] < threshold) {
+                pending.push_back(static_cast<int>(i));
+            }
+        }
+        if (pending.empty()) {
+            return;
+        }
+
+        // despeckle; NLM runs per tile since its search window would otherwise reach into neighbouring tiles
+        Mat denoised(static_cast<int>(pending.size()) * tileSize, tileSize, atlas.type());
+        for (size_t p = 0; p < pending.size(); p++) {
+            Mat tile = denoised.rowRange(static_cast<int>(p) * tileSize, static_cast<int>(p + 1) * tileSize);
+            fastNlMeansDenoising(atlas.rowRange(pending[p] * tileSize, (pending[p] + 1) * tileSize), tile, 50.0, 5, denoiseWindows[pending[p]]);
+        }
+
+        vector<int> retryDigits;
+        vector<float> retryConfidences;
+        classifier.classify(denoised, retryDigits, retryConfidences);
+
+        vector<int> ambiguous;
+        for (size_t p = 0; p < pending.size(); p++) {
+            digits[pending[p]] = retryDigits[p];
+            confidences[pending[p]] = retryConfidences[p];
+            stages[pending[p]] = STAGE_DENOISED;
+            if (retryConfidences[p] < threshold) {
+                ambiguous.push_back(static_cast<int>(p));
+            }
+        }
+        if (ambiguous.empty()) {
+            return;
+        }
+
+        // training digits are deskewed so try the same for cells that remain ambiguous
+        Mat deskewed(static_cast<int>(ambiguous.size()) * tileSize, tileSize, atlas.type());
+        for (size_t a = 0; a < ambiguous.size(); a++) {
+            Mat tile = deskewed.rowRange(static_cast<int>(a) * tileSize, static_cast<int>(a + 1) * tileSize);
+            deskewInto(denoised.rowRange(ambiguous[a] * tileSize, (ambiguous[a] + 1) * tileSize), tile);
+        }
+
+        classifier.classify(deskewed, retryDigits, retryConfidences);
+        for (size_t a = 0; a < ambiguous.size(); a++) {
+            int cell = pending[ambiguous[a]];
+            if (retryConfidences[a] > confidences[cell]) {
+                digits[cell] = retryDigits[a];
+                confidences[cell] = retryConfidences[a];
+                stages[cell] = STAGE_DESKEWED;
+            }
+        }
     }
 }
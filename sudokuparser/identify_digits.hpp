@@ -4,9 +4,25 @@
 #include <string>
 #include <opencv2/opencv.hpp>
 
+#include "digit_classifier.hpp"
+
 namespace Sudoku {
+    // Path the confidence cascade took to classify a cell
+    enum CascadeStage {
+        STAGE_EMPTY = 0,    // no digit found in the cell
+        STAGE_FAST = 1,     // resized digit classified as-is
+        STAGE_DENOISED = 2, // re-classified after despeckling
+        STAGE_DESKEWED = 3  // re-classified after despeckling and deskewing
+    };
+
     std::string TrainSVM(std::string pathName, int digitSize);
-    int IdentifyDigit(cv::Mat &digitMat);
+    void LoadSVM();
+    int IdentifyDigit(cv::Mat &digitMat, float &confidence);
+
+    // Classify square digit tiles stacked vertically in a single atlas Mat with the default classifier
+    void IdentifyDigits(const cv::Mat &atlas, std::vector<int> &digits, std::vector<float> &confidences);
+    void CascadeIdentifyDigits(const DigitClassifier &classifier, const cv::Mat &atlas, const std::vector<int> &denoiseWindows, float threshold,
+                               std::vector<int> &digits, std::vector<float> &confidences, std::vector<CascadeStage> &stages);
 }
 
 #endif
\ No newline at end of file
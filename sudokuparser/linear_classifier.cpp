@@ -0,0 +1,290 @@
+#include "digit_classifier.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <opencv2/opencv.hpp>
+#include <opencv2/ml.hpp>
+
+using namespace cv;
+using namespace cv::ml;
+using namespace std;
+
+namespace Sudoku {
+
+    enum LinearKind {
+        LINEAR_LOGISTIC,    // one-vs-rest logistic regression
+        LINEAR_CENTROID     // nearest class mean
+    };
+
+    enum WeightPrecision {
+        PRECISION_FLOAT32,
+        PRECISION_INT16,
+        PRECISION_INT8
+    };
+
+    // HOG features are L2-Hys normalized into [0, 1]; these scales keep every
+    // fixed-point dot product of the 81 feature descriptor within an int32 accumulator
+    const float INT16_FEATURE_SCALE = 1024.0f;
+    const int INT16_WEIGHT_MAX = 16383;
+    const float INT8_FEATURE_SCALE = 127.0f;
+    const int INT8_WEIGHT_MAX = 127;
+
+    /**
+    * Quantize each row of weights symmetrically to [-weightMax, weightMax], returning the
+    * per-row factor which converts an accumulated fixed-point score back to float
+    */
+    template<typename T>
+    static void quantizeRows(const Mat &weights, int weightMax, float featureScale, vector<T> &quantized, vector<float> &dequantize) {
+        quantized.resize(weights.total());
+        dequantize.resize(weights.rows);
+        for (int k = 0; k < weights.rows; k++) {
+            const float * row = weights.ptr<float>(k);
+            float largest = 0;
+            for (int f = 0; f < weights.cols; f++) {
+                largest = max(largest, fabs(row[f]));
+            }
+            float scale = largest > 0 ? weightMax / largest : 1.0f;
+            for (int f = 0; f < weights.cols; f++) {
+                quantized[k * weights.cols + f] = static_cast<T>(lrint(row[f] * scale));
+            }
+            dequantize[k] = 1.0f / (scale * featureScale);
+        }
+    }
+
+    /**
+    * Score one sample against every class with fixed-point weights.
+    * The inner loop is a plain multiply-accumulate over contiguous arrays which the compiler vectorizes
+    */
+    template<typename T>
+    static void fixedPointScores(const float * sample, int features, float featureScale, int featureMax,
+                                 const vector<T> &weights, const vector<float> &dequantize, const Mat &bias,
+                                 vector<T> &quantizedSample, float * scores) {
+        quantizedSample.resize(features);
+        for (int f = 0; f < features; f++) {
+            quantizedSample[f] = static_cast<T>(min(featureMax, static_cast<int>(lrint(sample[f] * featureScale))));
+        }
+
+        const int classes = static_cast<int>(dequantize.size());
+        for (int k = 0; k < classes; k++) {
+            const T * row = weights.data() + k * features;
+            int32_t acc = 0;
+            for (int f = 0; f < features; f++) {
+                acc += int32_t(row[f]) * int32_t(quantizedSample[f]);
+            }
+            scores[k] = acc * dequantize[k] + bias.at<float>(k, 0);
+        }
+    }
+
+    /**
+    * Digits scored by a single class-by-feature matrix product over the HOG descriptors:
+    * logistic regression directly, and nearest centroid as 2c.x - |c|^2 which ranks classes by distance
+    */
+    class LinearDigitClassifier : public DigitClassifier {
+    public:
+        LinearDigitClassifier(LinearKind kind, WeightPrecision precision, const Mat &classLabels, const Mat &weights, const Mat &bias)
+            : kind(kind), precision(precision), classLabels(classLabels), weights(weights), bias(bias) {
+            if (precision == PRECISION_INT16) {
+                quantizeRows(weights, INT16_WEIGHT_MAX, INT16_FEATURE_SCALE, weights16, dequantize);
+            } else if (precision == PRECISION_INT8) {
+                quantizeRows(weights, INT8_WEIGHT_MAX, INT8_FEATURE_SCALE, weights8, dequantize);
+            }
+        }
+
+        string name() const {
+            string base = kind == LINEAR_LOGISTIC ? "linear" : "centroid";
+            return base + (precision == PRECISION_INT16 ? "-int16" : precision == PRECISION_INT8 ? "-int8" : "");
+        }
+
+        void classify(const Mat &atlas, vector<int> &digits, vector<float> &confidences) const {
+            vector<float> descriptors;
+            Mat features = AtlasHOGFeatures(atlas, descriptors);
+            predict(features, digits, confidences);
+        }
+
+        void predict(const Mat &features, vector<int> &digits, vector<float> &confidences) const {
+            const int count = features.rows;
+            digits.assign(count, 0);
+            confidences.assign(count, 0.0f);
+            if (count == 0) {
+                return;
+            }
+
+            Mat scores;
+            if (precision == PRECISION_FLOAT32) {
+                gemm(features, weights, 1.0, repeat(bias.t(), count, 1), 1.0, scores, GEMM_2_T);
+            } else {
+                scores.create(count, weights.rows, CV_32FC1);
+                vector<int16_t> sample16;
+                vector<int8_t> sample8;
+                for (int i = 0; i < count; i++) {
+                    if (precision == PRECISION_INT16) {
+                        fixedPointScores(features.ptr<float>(i), features.cols, INT16_FEATURE_SCALE, INT16_WEIGHT_MAX,
+                                         weights16, dequantize, bias, sample16, scores.ptr<float>(i));
+                    } else {
+                        fixedPointScores(features.ptr<float>(i), features.cols, INT8_FEATURE_SCALE, INT8_WEIGHT_MAX,
+                                         weights8, dequantize, bias, sample8, scores.ptr<float>(i));
+                    }
+                }
+            }
+
+            for (int i = 0; i < count; i++) {
+                const float * row = scores.ptr<float>(i);
+                int best = 0;
+                int second = -1;
+                for (int k = 1; k < scores.cols; k++) {
+                    if (row[k] > row[best]) {
+                        second = best;
+                        best = k;
+                    } else if (second < 0 || row[k] > row[second]) {
+                        second = k;
+                    }
+                }
+                digits[i] = classLabels.at<int>(best, 0);
+
+                if (kind == LINEAR_LOGISTIC) {
+                    confidences[i] = float(1.0 / (1.0 + exp(-row[best])));
+                } else if (second >= 0) {
+                    // squared distances follow from the scores once |x|^2 is added back
+                    double norm = features.row(i).dot(features.row(i));
+                    double nearest = max(0.0, norm - row[best]);
+                    double runnerUp = max(0.0, norm - row[second]);
+                    confidences[i] = runnerUp > 0 ? float(1.0 - sqrt(nearest / runnerUp)) : 0.0f;
+                }
+            }
+        }
+
+    private:
+        LinearKind kind;
+        WeightPrecision precision;
+        Mat classLabels;
+        Mat weights;    // classes x features
+        Mat bias;       // classes x 1
+        vector<int16_t> weights16;
+        vector<int8_t> weights8;
+        vector<float> dequantize;
+    };
+
+    // Turn class centroids into the weights and bias of the equivalent linear scorer
+    static void centroidScorer(const Mat &centroids, Mat &weights, Mat &bias) {
+        weights = centroids * 2.0;
+        bias.create(centroids.rows, 1, CV_32FC1);
+        for (int k = 0; k < centroids.rows; k++) {
+            bias.at<float>(k, 0) = float(-centroids.row(k).dot(centroids.row(k)));
+        }
+    }
+
+    string LinearModelPath(const string &svmModelFile) {
+        size_t dot = svmModelFile.find_last_of('.');
+        size_t slash = svmModelFile.find_last_of('/');
+        string stem = dot != string::npos && (slash == string::npos || dot > slash) ? svmModelFile.substr(0, dot) : svmModelFile;
+        return stem + "_linear.yml";
+    }
+
+    shared_ptr<const DigitClassifier> CreateLinearDigitClassifier(const string &backend, const string &modelPath) {
+        size_t dash = backend.find('-');
+        string kindName = backend.substr(0, dash);
+        string precisionName = dash == string::npos ? "" : backend.substr(dash + 1);
+
+        WeightPrecision precision;
+        if (precisionName.empty()) {
+            precision = PRECISION_FLOAT32;
+        } else if (precisionName == "int16") {
+            precision = PRECISION_INT16;
+        } else if (precisionName == "int8") {
+            precision = PRECISION_INT8;
+        } else {
+            throw invalid_argument("Unknown digit classifier backend: " + backend);
+        }
+
+        FileStorage fs(modelPath, FileStorage::READ);
+        if (!fs.isOpened()) {
+            throw invalid_argument("Invalid model file: " + modelPath);
+        }
+        Mat classLabels, weights, bias;
+        fs["class_labels"] >> classLabels;
+        LinearKind kind;
+        if (kindName == "linear") {
+            kind = LINEAR_LOGISTIC;
+            fs["logistic_weights"] >> weights;
+            fs["logistic_bias"] >> bias;
+        } else if (kindName == "centroid") {
+            kind = LINEAR_CENTROID;
+            Mat centroids;
+            fs["centroids"] >> centroids;
+            centroidScorer(centroids, weights, bias);
+        } else {
+            throw invalid_argument("Unknown digit classifier backend: " + backend);
+        }
+        if (classLabels.empty() || weights.rows != classLabels.rows || bias.rows != classLabels.rows) {
+            throw invalid_argument("Invalid model file: " + modelPath);
+        }
+
+        SUDOKU_LOG_INFO("initialized linear digit classifier", {{"backend", backend}, {"file", modelPath}});
+        return make_shared<LinearDigitClassifier>(kind, precision, classLabels, weights, bias);
+    }
+
+    static float testAccuracy(const LinearDigitClassifier &classifier, const Mat &testMat, const vector<int> &testLabels) {
+        vector<int> predicted;
+        vector<float> confidences;
+        classifier.predict(testMat, predicted, confidences);
+        int correct = 0;
+        for (size_t i = 0; i < predicted.size(); i++) {
+            correct += predicted[i] == testLabels[i] ? 1 : 0;
+        }
+        return predicted.empty() ? 0.0f : 100.0f * correct / predicted.size();
+    }
+
+    void TrainLinearModels(const Mat &trainMat, const vector<int> &trainLabels,
+                           const Mat &testMat, const vector<int> &testLabels, const string &modelFile) {
+        // classes in ascending label order, matching the rows of the learnt thetas
+        vector<int> labels(trainLabels);
+        sort(labels.begin(), labels.end());
+        labels.erase(unique(labels.begin(), labels.end()), labels.end());
+        Mat classLabels = Mat(labels, true);
+
+        Mat responses;
+        Mat(trainLabels, true).convertTo(responses, CV_32FC1);
+        Ptr<LogisticRegression> lr = LogisticRegression::create();
+        lr->setLearningRate(0.1);
+        lr->setIterations(2000);
+        lr->setRegularization(LogisticRegression::REG_L2);
+        lr->setTrainMethod(LogisticRegression::BATCH);
+        lr->train(trainMat, ROW_SAMPLE, responses);
+
+        // the first column of each theta row is the intercept
+        Mat thetas = lr->get_learnt_thetas();
+        Mat logisticWeights = thetas.colRange(1, thetas.cols).clone();
+        Mat logisticBias = thetas.col(0).clone();
+
+        Mat centroids = Mat::zeros(classLabels.rows, trainMat.cols, CV_32FC1);
+        vector<int> counts(classLabels.rows, 0);
+        for (int i = 0; i < trainMat.rows; i++) {
+            int k = static_cast<int>(lower_bound(labels.begin(), labels.end(), trainLabels[i]) - labels.begin());
+            centroids.row(k) += trainMat.row(i);
+            counts[k]++;
+        }
+        for (int k = 0; k < centroids.rows; k++) {
+            centroids.row(k) /= max(counts[k], 1);
+        }
+
+        FileStorage fs(modelFile, FileStorage::WRITE);
+        fs << "class_labels" << classLabels;
+        fs << "logistic_weights" << logisticWeights;
+        fs << "logistic_bias" << logisticBias;
+        fs << "centroids" << centroids;
+        fs.release();
+
+        Mat centroidWeights, centroidBias;
+        centroidScorer(centroids, centroidWeights, centroidBias);
+        for (WeightPrecision precision : {PRECISION_FLOAT32, PRECISION_INT16, PRECISION_INT8}) {
+            LinearDigitClassifier logistic(LINEAR_LOGISTIC, precision, classLabels, logisticWeights, logisticBias);
+            LinearDigitClassifier centroid(LINEAR_CENTROID, precision, classLabels, centroidWeights, centroidBias);
+            SUDOKU_LOG_INFO("linear model accuracy", {{"backend", logistic.name()}, {"accuracy", testAccuracy(logistic, testMat, testLabels)}});
+            SUDOKU_LOG_INFO("linear model accuracy", {{"backend", centroid.name()}, {"accuracy", testAccuracy(centroid, testMat, testLabels)}});
+        }
+        SUDOKU_LOG_INFO("saved linear models", {{"file", modelFile}});
+    }
+}
@@ -0,0 +1,166 @@
+#include "logging.hpp"
+#include "ring_buffer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <strings.h>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace Sudoku {
+
+    const char *LOG_LEVEL_ENV_VAR_NAME = "GO_SUDOKU_LOG_LEVEL";
+
+    // Records buffered between producers and the writer thread
+    const size_t LOG_RING_CAPACITY = 1024;
+
+    // Formatted size of a single record, including its fields
+    const size_t LOG_RECORD_SIZE = 256;
+
+    // How long the writer sleeps when the ring is empty
+    const int LOG_IDLE_MS = 5;
+
+    struct LogRecord {
+        LogLevel level;
+        chrono::system_clock::time_point time;
+        char text[LOG_RECORD_SIZE];
+    };
+
+    static const char * levelNames[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "OFF" };
+
+    static LogLevel runtimeLevel() {
+        const char * val = getenv(LOG_LEVEL_ENV_VAR_NAME);
+        if (val != NULL) {
+            for (int level = LEVEL_TRACE; level <= LEVEL_OFF; level++) {
+                if (strcasecmp(val, levelNames[level]) == 0) {
+                    return static_cast<LogLevel>(level);
+                }
+            }
+        }
+        return LEVEL_INFO;
+    }
+
+    /**
+    * Producers format into a lock-free ring; a single background thread does all console I/O
+    */
+    class AsyncLogWriter {
+    public:
+        AsyncLogWriter() : ring(LOG_RING_CAPACITY), written(0), queued(0), dropped(0), stopping(false) {
+            writer = thread(&AsyncLogWriter::run, this);
+        }
+
+        ~AsyncLogWriter() {
+            stopping = true;
+            writer.join();
+        }
+
+        void push(const LogRecord &record) {
+            if (ring.tryPush(record)) {
+                queued++;
+            } else {
+                dropped++;
+            }
+        }
+
+        void flush() {
+            while (written.load() < queued.load() && !stopping) {
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+        }
+
+    private:
+        void run() {
+            LogRecord record;
+            for (;;) {
+                bool idle = true;
+                while (ring.tryPop(record)) {
+                    write(record);
+                    written++;
+                    idle = false;
+                }
+
+                size_t lost = dropped.exchange(0);
+                if (lost > 0) {
+                    fprintf(stderr, "WARN log ring full lost=%zu\n", lost);
+                }
+
+                if (idle) {
+                    if (stopping) {
+                        fflush(stderr);
+                        return;
+                    }
+                    fflush(stderr);
+                    this_thread::sleep_for(chrono::milliseconds(LOG_IDLE_MS));
+                }
+            }
+        }
+
+        void write(const LogRecord &record) {
+            time_t seconds = chrono::system_clock::to_time_t(record.time);
+            long millis = static_cast<long>(chrono::duration_cast<chrono::milliseconds>(record.time.time_since_epoch()).count() % 1000);
+            tm utc;
+            gmtime_r(&seconds, &utc);
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+            fprintf(stderr, "%s.%03ldZ %-5s %s\n", stamp, millis, levelNames[record.level], record.text);
+        }
+
+        RingBuffer<LogRecord> ring;
+        atomic<size_t> written;
+        atomic<size_t> queued;
+        atomic<size_t> dropped;
+        atomic<bool> stopping;
+        thread writer;
+    };
+
+    static AsyncLogWriter& logWriter() {
+        static AsyncLogWriter writer;
+        return writer;
+    }
+
+    bool LogEnabled(LogLevel level) {
+        static const LogLevel minimum = runtimeLevel();
+        return level >= minimum && level < LEVEL_OFF;
+    }
+
+    void LogWrite(LogLevel level, const char * message, initializer_list<LogField> fields) {
+        LogRecord record;
+        record.level = level;
+        record.time = chrono::system_clock::now();
+
+        size_t used = 0;
+        int count = snprintf(record.text, LOG_RECORD_SIZE, "%s", message);
+        used = count > 0 ? min(static_cast<size_t>(count), LOG_RECORD_SIZE - 1) : 0;
+        for (const LogField &field : fields) {
+            if (used >= LOG_RECORD_SIZE - 1) {
+                break;
+            }
+            char * pos = record.text + used;
+            size_t remaining = LOG_RECORD_SIZE - used;
+            switch (field.kind) {
+                case LogField::INTEGER:
+                    count = snprintf(pos, remaining, " %s=%lld", field.key, field.integer);
+                    break;
+                case LogField::REAL:
+                    count = snprintf(pos, remaining, " %s=%g", field.key, field.real);
+                    break;
+                case LogField::TEXT:
+                    count = snprintf(pos, remaining, " %s=\"%s\"", field.key, field.text ? field.text : "");
+                    break;
+            }
+            used += count > 0 ? min(static_cast<size_t>(count), remaining - 1) : 0;
+        }
+
+        logWriter().push(record);
+    }
+
+    void LogFlush() {
+        logWriter().flush();
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef  LOGGING_INC
+#define  LOGGING_INC
+
+#include <initializer_list>
+#include <string>
+
+// Levels below this are compiled out entirely; build with -DSUDOKU_LOG_MIN_LEVEL=0 to keep trace logging
+#ifndef SUDOKU_LOG_MIN_LEVEL
+#define SUDOKU_LOG_MIN_LEVEL 2
+#endif
+
+namespace Sudoku {
+    enum LogLevel {
+        LEVEL_TRACE = 0,
+        LEVEL_DEBUG = 1,
+        LEVEL_INFO = 2,
+        LEVEL_WARN = 3,
+        LEVEL_ERROR = 4,
+        LEVEL_OFF = 5
+    };
+
+    // Environment variable selecting the runtime level: trace, debug, info, warn, error or off
+    extern const char *LOG_LEVEL_ENV_VAR_NAME;
+
+    /**
+    * Structured key/value attached to a log record.  Values are formatted when the record is
+    * written so string fields only need to outlive the logging call
+    */
+    struct LogField {
+        enum Kind { INTEGER, REAL, TEXT };
+
+        LogField(const char * key, int value) : key(key), kind(INTEGER), integer(value) {}
+        LogField(const char * key, long value) : key(key), kind(INTEGER), integer(value) {}
+        LogField(const char * key, long long value) : key(key), kind(INTEGER), integer(value) {}
+        LogField(const char * key, unsigned int value) : key(key), kind(INTEGER), integer(value) {}
+        LogField(const char * key, unsigned long value) : key(key), kind(INTEGER), integer(static_cast<long long>(value)) {}
+        LogField(const char * key, double value) : key(key), kind(REAL), real(value) {}
+        LogField(const char * key, const char * value) : key(key), kind(TEXT), text(value) {}
+        LogField(const char * key, const std::string &value) : key(key), kind(TEXT), text(value.c_str()) {}
+
+        const char * key;
+        Kind kind;
+        union {
+            long long integer;
+            double real;
+            const char * text;
+        };
+    };
+
+    bool LogEnabled(LogLevel level);
+
+    // Format the record and hand it to the background writer; drops the record rather than block when the ring is full
+    void LogWrite(LogLevel level, const char * message, std::initializer_list<LogField> fields = {});
+
+    // Block until every queued record has been written
+    void LogFlush();
+}
+
+#define SUDOKU_LOG(level, ...) do { if (Sudoku::LogEnabled(level)) { Sudoku::LogWrite(level, __VA_ARGS__); } } while (0)
+
+#if SUDOKU_LOG_MIN_LEVEL <= 0
+#define SUDOKU_LOG_TRACE(...) SUDOKU_LOG(Sudoku::LEVEL_TRACE, __VA_ARGS__)
+#else
+#define SUDOKU_LOG_TRACE(...) do {} while (0)
+#endif
+
+#if SUDOKU_LOG_MIN_LEVEL <= 1
+#define SUDOKU_LOG_DEBUG(...) SUDOKU_LOG(Sudoku::LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define SUDOKU_LOG_DEBUG(...) do {} while (0)
+#endif
+
+#if SUDOKU_LOG_MIN_LEVEL <= 2
+#define SUDOKU_LOG_INFO(...) SUDOKU_LOG(Sudoku::LEVEL_INFO, __VA_ARGS__)
+#else
+#define SUDOKU_LOG_INFO(...) do {} while (0)
+#endif
+
+#if SUDOKU_LOG_MIN_LEVEL <= 3
+#define SUDOKU_LOG_WARN(...) SUDOKU_LOG(Sudoku::LEVEL_WARN, __VA_ARGS__)
+#else
+#define SUDOKU_LOG_WARN(...) do {} while (0)
+#endif
+
+#if SUDOKU_LOG_MIN_LEVEL <= 4
+#define SUDOKU_LOG_ERROR(...) SUDOKU_LOG(Sudoku::LEVEL_ERROR, __VA_ARGS__)
+#else
+#define SUDOKU_LOG_ERROR(...) do {} while (0)
+#endif
+
+#endif
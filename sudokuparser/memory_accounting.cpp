@@ -0,0 +1,167 @@
+#include "memory_accounting.hpp"
+#include "logging.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <opencv2/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+namespace Sudoku {
+
+    struct MemoryAccount::Counters {
+        // one reference per handle plus one per live buffer recorded against the account
+        atomic<size_t> references;
+        atomic<size_t> liveBytes;
+        atomic<size_t> allocatedBytes;
+        atomic<size_t> peakBytes;
+    };
+
+    static atomic<size_t> totalLiveBytes(0);
+    static atomic<size_t> totalPeakLiveBytes(0);
+    static atomic<size_t> totalPeakParseBytes(0);
+
+    // Account of the innermost MemoryScope on this thread
+    static thread_local MemoryAccount::Counters * activeCounters = NULL;
+
+    static void raise(atomic<size_t> &peak, size_t value) {
+        size_t current = peak.load(memory_order_relaxed);
+        while (value > current && !peak.compare_exchange_weak(current, value, memory_order_relaxed)) {
+        }
+    }
+
+    static void retain(MemoryAccount::Counters * counters) {
+        counters->references.fetch_add(1, memory_order_relaxed);
+    }
+
+    static void release(MemoryAccount::Counters * counters) {
+        if (counters->references.fetch_sub(1, memory_order_acq_rel) == 1) {
+            delete counters;
+        }
+    }
+
+    /**
+    * OpenCV's standard allocator with every buffer it hands out counted, and charged to the account
+    * in scope on the allocating thread.  The account travels with the buffer so it can be freed anywhere
+    */
+    class AccountingAllocator : public MatAllocator {
+    public:
+        UMatData* allocate(int dims, const int* sizes, int type, void* data0, size_t* step,
+                           int /*flags*/, UMatUsageFlags /*usageFlags*/) const {
+            size_t total = CV_ELEM_SIZE(type);
+            for (int i = dims - 1; i >= 0; i--) {
+                if (step) {
+                    if (data0 && step[i] != CV_AUTOSTEP) {
+                        CV_Assert(total <= step[i]);
+                        total = step[i];
+                    } else {
+                        step[i] = total;
+                    }
+                }
+                total *= sizes[i];
+            }
+
+            UMatData* u = new UMatData(this);
+            u->data = u->origdata = data0 ? static_cast<uchar*>(data0) : static_cast<uchar*>(fastMalloc(total));
+            u->size = total;
+            u->userdata = NULL;
+            if (data0) {
+                // wraps memory owned by the caller
+                u->flags |= UMatData::USER_ALLOCATED;
+                return u;
+            }
+
+            raise(totalPeakLiveBytes, totalLiveBytes.fetch_add(total, memory_order_relaxed) + total);
+            MemoryAccount::Counters * counters = activeCounters;
+            if (counters) {
+                retain(counters);
+                u->userdata = counters;
+                counters->allocatedBytes.fetch_add(total, memory_order_relaxed);
+                size_t live = counters->liveBytes.fetch_add(total, memory_order_relaxed) + total;
+                raise(counters->peakBytes, live);
+                raise(totalPeakParseBytes, live);
+            }
+            return u;
+        }
+
+        bool allocate(UMatData* u, int /*accessFlags*/, UMatUsageFlags /*usageFlags*/) const {
+            return u != NULL;
+        }
+
+        void deallocate(UMatData* u) const {
+            if (!u) {
+                return;
+            }
+            CV_Assert(u->urefcount == 0);
+            CV_Assert(u->refcount == 0);
+            if (!(u->flags & UMatData::USER_ALLOCATED)) {
+                fastFree(u->origdata);
+                u->origdata = NULL;
+                totalLiveBytes.fetch_sub(u->size, memory_order_relaxed);
+                MemoryAccount::Counters * counters = static_cast<MemoryAccount::Counters*>(u->userdata);
+                if (counters) {
+                    counters->liveBytes.fetch_sub(u->size, memory_order_relaxed);
+                    release(counters);
+                }
+            }
+            delete u;
+        }
+    };
+
+    static once_flag allocatorInstalled;
+
+    void InstallMemoryAccounting() {
+        call_once(allocatorInstalled, [] {
+            // never destroyed, as Mats in static storage may be freed after it would be
+            static AccountingAllocator * allocator = new AccountingAllocator();
+            Mat::setDefaultAllocator(allocator);
+            SUDOKU_LOG_DEBUG("installed memory accounting allocator");
+        });
+    }
+
+    MemoryAccount::MemoryAccount() : counters(new Counters()) {
+        counters->references = 1;
+        counters->liveBytes = 0;
+        counters->allocatedBytes = 0;
+        counters->peakBytes = 0;
+    }
+
+    MemoryAccount::MemoryAccount(const MemoryAccount &other) : counters(other.counters) {
+        retain(counters);
+    }
+
+    MemoryAccount& MemoryAccount::operator=(const MemoryAccount &other) {
+        retain(other.counters);
+        release(counters);
+        counters = other.counters;
+        return *this;
+    }
+
+    MemoryAccount::~MemoryAccount() {
+        release(counters);
+    }
+
+    MemoryUsage MemoryAccount::usage() const {
+        MemoryUsage usage;
+        usage.allocatedBytes = counters->allocatedBytes.load(memory_order_relaxed);
+        usage.peakBytes = counters->peakBytes.load(memory_order_relaxed);
+        return usage;
+    }
+
+    MemoryScope::MemoryScope(const MemoryAccount &account) : previous(activeCounters) {
+        activeCounters = account.counters;
+    }
+
+    MemoryScope::~MemoryScope() {
+        activeCounters = previous;
+    }
+
+    MemoryTotals CurrentMemoryTotals() {
+        MemoryTotals totals;
+        totals.liveBytes = totalLiveBytes.load(memory_order_relaxed);
+        totals.peakLiveBytes = totalPeakLiveBytes.load(memory_order_relaxed);
+        totals.peakParseBytes = totalPeakParseBytes.load(memory_order_relaxed);
+        return totals;
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef  MEMORY_ACCOUNTING_INC
+#define  MEMORY_ACCOUNTING_INC
+
+#include <cstddef>
+
+namespace Sudoku {
+    // Mat data allocated while an account was in scope
+    struct MemoryUsage {
+        size_t allocatedBytes;  // everything allocated, including buffers since freed
+        size_t peakBytes;       // most held at once
+    };
+
+    // Mat data allocated by the accounting allocator across the whole process
+    struct MemoryTotals {
+        size_t liveBytes;
+        size_t peakLiveBytes;
+        size_t peakParseBytes;  // largest MemoryUsage::peakBytes of any account
+    };
+
+    /**
+    * Shared handle to the Mat data counters of one parse.  Copies refer to the same counters,
+    * which outlive the last handle until every buffer they recorded has been freed
+    */
+    class MemoryAccount {
+    public:
+        MemoryAccount();
+        MemoryAccount(const MemoryAccount &other);
+        MemoryAccount& operator=(const MemoryAccount &other);
+        ~MemoryAccount();
+
+        MemoryUsage usage() const;
+
+        struct Counters;
+
+    private:
+        Counters * counters;
+
+        friend class MemoryScope;
+    };
+
+    /**
+    * Make the accounting allocator OpenCV's default.  OpenCV reads its default allocator without
+    * synchronization, so call this before starting any thread that allocates Mats; later calls do nothing
+    */
+    void InstallMemoryAccounting();
+
+    /**
+    * Records the Mat data allocated on the calling thread against account while in scope, once
+    * InstallMemoryAccounting has run.  Scopes nest with the innermost winning.
+    * Buffers allocated by OpenCV's own threads inside parallel loops count only towards MemoryTotals
+    */
+    class MemoryScope {
+    public:
+        explicit MemoryScope(const MemoryAccount &account);
+        ~MemoryScope();
+
+        MemoryScope(const MemoryScope&) = delete;
+        MemoryScope& operator=(const MemoryScope&) = delete;
+
+    private:
+        MemoryAccount::Counters * previous;
+    };
+
+    MemoryTotals CurrentMemoryTotals();
+}
+
+#endif
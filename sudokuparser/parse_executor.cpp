@@ -0,0 +1,165 @@
+#include "parse_executor.hpp"
+#include "logging.hpp"
+#include "memory_accounting.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <opencv2/core.hpp>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+namespace Sudoku {
+
+    const char *THREADING_ENV_VAR_NAME = "GO_SUDOKU_THREADING";
+
+    size_t DefaultWorkerCount() {
+        unsigned int cores = thread::hardware_concurrency();
+        return cores > 0 ? cores : 1;
+    }
+
+    ThreadingPolicy ThreadingPolicyFromEnv() {
+        const char * val = getenv(THREADING_ENV_VAR_NAME);
+        if (val != NULL && strcmp(val, "intra") == 0) {
+            return THREADING_INTRA_IMAGE;
+        } else if (val != NULL && strcmp(val, "inter") == 0) {
+            return THREADING_INTER_IMAGE;
+        }
+        return THREADING_DEFAULT;
+    }
+
+    // Whether ApplyThreadingPolicy has changed OpenCV's thread count from what the process started with
+    static atomic<bool> threadsOverridden(false);
+
+    size_t ApplyThreadingPolicy(ThreadingPolicy policy) {
+        switch (policy) {
+            case THREADING_INTRA_IMAGE:
+                cv::setNumThreads(static_cast<int>(DefaultWorkerCount()));
+                threadsOverridden = true;
+                return 1;
+            case THREADING_INTER_IMAGE:
+                // parallel_for_ then runs inline on the calling worker
+                cv::setNumThreads(1);
+                threadsOverridden = true;
+                return DefaultWorkerCount();
+            default:
+                if (threadsOverridden.exchange(false)) {
+                    // a negative count restores OpenCV's default
+                    cv::setNumThreads(-1);
+                }
+                return DefaultWorkerCount();
+        }
+    }
+
+    bool PinCurrentThread(size_t core) {
+    #ifdef __linux__
+        // a cpuset or taskset may leave only some CPUs, numbered anywhere, for this process
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            SUDOKU_LOG_WARN("unable to read allowed cpus", {{"error", strerror(errno)}});
+            return false;
+        }
+        int target = static_cast<int>(core % max(CPU_COUNT(&allowed), 1));
+        int cpu = 0;
+        for (; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+                break;
+            }
+        }
+        if (cpu == CPU_SETSIZE) {
+            return false;
+        }
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (error != 0) {
+            SUDOKU_LOG_WARN("unable to set thread affinity", {{"cpu", cpu}, {"error", strerror(error)}});
+            return false;
+        }
+        return true;
+    #else
+        return false;
+    #endif
+    }
+
+    ParseExecutor::ParseExecutor(size_t workerCount, size_t queueCapacity, bool pinWorkers)
+        : capacity(max<size_t>(queueCapacity, 1)), pinWorkers(pinWorkers), stopping(false) {
+        InstallMemoryAccounting();
+        for (size_t i = 0; i < max<size_t>(workerCount, 1); i++) {
+            workers.emplace_back(&ParseExecutor::run, this, i);
+        }
+    }
+
+    /**
+    * Drain queued tasks then join the workers
+    */
+    ParseExecutor::~ParseExecutor() {
+        {
+            lock_guard<mutex> lock(tasksMutex);
+            stopping = true;
+        }
+        notEmpty.notify_all();
+        notFull.notify_all();
+        for (thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    bool ParseExecutor::submit(Task task, bool block) {
+        {
+            unique_lock<mutex> lock(tasksMutex);
+            if (block) {
+                notFull.wait(lock, [this] { return stopping || tasks.size() < capacity; });
+            }
+            if (stopping || tasks.size() >= capacity) {
+                return false;
+            }
+            tasks.push_back(move(task));
+        }
+        notEmpty.notify_one();
+        return true;
+    }
+
+    size_t ParseExecutor::queueDepth() {
+        lock_guard<mutex> lock(tasksMutex);
+        return tasks.size();
+    }
+
+    void ParseExecutor::run(size_t index) {
+        if (pinWorkers && !PinCurrentThread(index)) {
+            SUDOKU_LOG_WARN("unable to pin parse worker", {{"worker", index}});
+        }
+
+        for (;;) {
+            Task task;
+            {
+                unique_lock<mutex> lock(tasksMutex);
+                notEmpty.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = move(tasks.front());
+                tasks.pop_front();
+            }
+            notFull.notify_one();
+
+            try {
+                task();
+            } catch (const std::exception& e) {
+                SUDOKU_LOG_ERROR("exception escaped executor task", {{"error", e.what()}});
+            } catch (...) {
+                SUDOKU_LOG_ERROR("exception escaped executor task");
+            }
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef  PARSE_EXECUTOR_INC
+#define  PARSE_EXECUTOR_INC
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Sudoku {
+    extern const char *THREADING_ENV_VAR_NAME;
+
+    /**
+    * How cores are split between concurrent parses and OpenCV's own parallel loops
+    */
+    enum ThreadingPolicy {
+        THREADING_DEFAULT = 0,      // one parse worker per core; OpenCV's thread pool left as configured
+        THREADING_INTRA_IMAGE = 1,  // a single parse worker whose OpenCV calls use every core
+        THREADING_INTER_IMAGE = 2   // single-threaded OpenCV with one parse worker per core
+    };
+
+    /**
+    * Fixed pool of worker threads fed from a bounded FIFO queue.
+    * Submitting to a full queue either blocks the caller or is rejected
+    */
+    class ParseExecutor {
+    public:
+        using Task = std::function<void()>;
+
+        // pinWorkers binds worker i to core i modulo the core count where supported
+        ParseExecutor(size_t workerCount, size_t queueCapacity, bool pinWorkers = false);
+        ~ParseExecutor();
+
+        ParseExecutor(const ParseExecutor&) = delete;
+        ParseExecutor& operator=(const ParseExecutor&) = delete;
+
+        // Queue task; returns false without queueing if the queue is full and block is false
+        bool submit(Task task, bool block);
+
+        size_t workerCount() const { return workers.size(); }
+        size_t queueCapacity() const { return capacity; }
+        size_t queueDepth();
+
+    private:
+        void run(size_t index);
+
+        size_t capacity;
+        bool pinWorkers;
+        bool stopping;
+        std::deque<Task> tasks;
+        std::mutex tasksMutex;
+        std::condition_variable notEmpty;
+        std::condition_variable notFull;
+        std::vector<std::thread> workers;
+    };
+
+    // Worker count used when none is configured: one per core
+    size_t DefaultWorkerCount();
+
+    // "intra" or "inter" from GO_SUDOKU_THREADING, otherwise THREADING_DEFAULT
+    ThreadingPolicy ThreadingPolicyFromEnv();
+
+    /**
+    * Set OpenCV's thread count for policy and return the number of parse workers it calls for.
+    * OpenCV's thread count is process wide, so the policy applies to every parse in the process
+    */
+    size_t ApplyThreadingPolicy(ThreadingPolicy policy);
+
+    // Bind the calling thread to the core-th, wrapping around, of the CPUs the process may run on;
+    // returns false where affinity is unsupported or cannot be set
+    bool PinCurrentThread(size_t core);
+}
+
+#endif
@@ -0,0 +1,299 @@
+#include "parse_pipeline.hpp"
+#include "parse_executor.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <opencv2/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+namespace Sudoku {
+
+    const size_t DEFAULT_PIPELINE_QUEUE_PER_THREAD = 4;
+    const size_t DEFAULT_PIPELINE_BATCH = 8;
+
+    // An image moving through the stages; owned by whichever queue or stage holds it
+    struct ParsePipeline::Job {
+        shared_ptr<vector<char> > data;
+        shared_ptr<const ParseContext> context;
+        Completion completion;
+        SudokuParseResult result;
+        ParseRequest request;
+        Mat image;
+        BoardDigits board;
+        MemoryAccount memory;   // charged by the decode and detect stages
+    };
+
+    PipelineConfig DefaultPipelineConfig() {
+        size_t cores = DefaultWorkerCount();
+        PipelineConfig config;
+        config.decodeThreads = 1;
+        config.classifyThreads = 1;
+        config.detectThreads = cores > 2 ? cores - 2 : 1;
+        config.queueCapacity = DEFAULT_PIPELINE_QUEUE_PER_THREAD * cores;
+        config.maxBatch = DEFAULT_PIPELINE_BATCH;
+        return config;
+    }
+
+    static PipelineConfig sanitized(PipelineConfig config) {
+        config.decodeThreads = max<size_t>(config.decodeThreads, 1);
+        config.detectThreads = max<size_t>(config.detectThreads, 1);
+        config.classifyThreads = max<size_t>(config.classifyThreads, 1);
+        config.queueCapacity = max<size_t>(config.queueCapacity, 1);
+        config.maxBatch = max<size_t>(config.maxBatch, 1);
+        return config;
+    }
+
+    bool ParsePipeline::StageQueue::push(Job * job) {
+        while (!tryPush(job)) {
+            unique_lock<mutex> lock(waitMutex);
+            fullWaiters++;
+            atomic_thread_fence(memory_order_seq_cst);
+            // a pop landing between the failed push and this check sees the count, so look again under the lock
+            notFull.wait(lock, [this] { return closed || ring.size() < ring.capacity(); });
+            fullWaiters--;
+            if (closed) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ParsePipeline::StageQueue::tryPush(Job * job) {
+        if (closed || !ring.tryPush(job)) {
+            return false;
+        }
+        wake(notEmpty, emptyWaiters);
+        return true;
+    }
+
+    bool ParsePipeline::StageQueue::pop(Job *& job) {
+        while (!tryPop(job)) {
+            unique_lock<mutex> lock(waitMutex);
+            emptyWaiters++;
+            atomic_thread_fence(memory_order_seq_cst);
+            notEmpty.wait(lock, [this] { return closed || ring.size() > 0; });
+            emptyWaiters--;
+            if (closed && ring.size() == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ParsePipeline::StageQueue::tryPop(Job *& job) {
+        if (!ring.tryPop(job)) {
+            return false;
+        }
+        wake(notFull, fullWaiters);
+        return true;
+    }
+
+    void ParsePipeline::StageQueue::close() {
+        {
+            lock_guard<mutex> lock(waitMutex);
+            closed = true;
+        }
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+    /**
+    * The ring changed without the lock.  Fenced against the fence a waiter makes after counting itself, either
+    * this sees the waiter and takes the lock before notifying, so the waiter is already waiting, or the waiter's
+    * check sees the change and it never waits
+    */
+    void ParsePipeline::StageQueue::wake(condition_variable &condition, const atomic<int> &waiters) {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (waiters.load(memory_order_relaxed) == 0) {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(waitMutex);
+        }
+        condition.notify_one();
+    }
+
+    static void fail(ParseRequest &request) {
+        request.error = current_exception();
+        request.result->status = IsNoGridError(request.error) ? SUDOKU_PARSE_NO_GRID : SUDOKU_PARSE_ERROR;
+    }
+
+    /**
+    * Hand on job to queue, or, should the pipeline be shutting down, complete it as failed
+    */
+    void ParsePipeline::forward(StageQueue &queue, Job * job) {
+        if (queue.push(job)) {
+            return;
+        }
+        try {
+            throw runtime_error("parse pipeline closed");
+        } catch (...) {
+            fail(job->request);
+        }
+        if (job->completion) {
+            job->completion(job->result, job->request.error);
+        }
+        delete job;
+    }
+
+    ParsePipeline::ParsePipeline(const PipelineConfig &config)
+        : settings(sanitized(config)), decodeQueue(settings.queueCapacity), detectQueue(settings.queueCapacity),
+          classifyQueue(settings.queueCapacity) {
+        InstallMemoryAccounting();
+        for (size_t i = 0; i < settings.decodeThreads; i++) {
+            decodeThreads.emplace_back(&ParsePipeline::decodeStage, this);
+        }
+        for (size_t i = 0; i < settings.detectThreads; i++) {
+            detectThreads.emplace_back(&ParsePipeline::detectStage, this);
+        }
+        for (size_t i = 0; i < settings.classifyThreads; i++) {
+            classifyThreads.emplace_back(&ParsePipeline::classifyStage, this);
+        }
+    }
+
+    /**
+    * Close each stage in turn once the one before has drained into it, then join its threads
+    */
+    ParsePipeline::~ParsePipeline() {
+        decodeQueue.close();
+        for (thread &stage : decodeThreads) { stage.join(); }
+        detectQueue.close();
+        for (thread &stage : detectThreads) { stage.join(); }
+        classifyQueue.close();
+        for (thread &stage : classifyThreads) { stage.join(); }
+    }
+
+    bool ParsePipeline::submit(shared_ptr<vector<char> > data, const float * corners,
+                               shared_ptr<const ParseContext> context, Completion completion, bool block) {
+        Job * job = new Job();
+        job->data = data;
+        job->context = context;
+        job->completion = completion;
+        if (corners) {
+            copy(corners, corners + 8, job->result.gridPoints);
+        } else {
+            fill(job->result.gridPoints, job->result.gridPoints + 8, -1.0f);
+        }
+        internalClearResult(&job->result);
+        job->request.encodedImageData = job->data->data();
+        job->request.length = static_cast<int>(job->data->size());
+        job->request.result = &job->result;
+
+        if (!(block ? decodeQueue.push(job) : decodeQueue.tryPush(job))) {
+            delete job;
+            return false;
+        }
+        return true;
+    }
+
+    size_t ParsePipeline::capacity() const {
+        // later queues fill only from earlier stages, so admission is bounded by the first alone
+        return decodeQueue.capacity();
+    }
+
+    PipelineDepths ParsePipeline::depths() const {
+        PipelineDepths depths;
+        depths.decode = decodeQueue.size();
+        depths.detect = detectQueue.size();
+        depths.classify = classifyQueue.size();
+        return depths;
+    }
+
+    void ParsePipeline::decodeStage() {
+        Job * job;
+        while (decodeQueue.pop(job)) {
+            {
+                MemoryScope scope(job->memory);
+                try {
+                    job->image = internalDecodeBoard(job->request);
+                } catch (...) {
+                    fail(job->request);
+                }
+            }
+            forward(detectQueue, job);
+        }
+    }
+
+    void ParsePipeline::detectStage() {
+        Job * job;
+        while (detectQueue.pop(job)) {
+            {
+                MemoryScope scope(job->memory);
+                if (!job->request.error) {
+                    try {
+                        internalDetectBoard(job->request, job->image, job->board);
+                    } catch (...) {
+                        fail(job->request);
+                        job->board.digits.clear();
+                    }
+                }
+                // the full-size image is not needed once the grid has been flattened
+                job->image.release();
+            }
+            internalRecordMemory(&job->result, job->memory);
+            forward(classifyQueue, job);
+        }
+    }
+
+    void ParsePipeline::classifyStage() {
+        vector<Job*> batch;
+        Job * job;
+        while (classifyQueue.pop(job)) {
+            // take whatever else has arrived, up to a batch, without waiting for more
+            batch.push_back(job);
+            while (batch.size() < settings.maxBatch && classifyQueue.tryPop(job)) {
+                batch.push_back(job);
+            }
+
+            classifyBatch(batch);
+            for (Job * done : batch) {
+                if (done->completion) {
+                    done->completion(done->result, done->request.error);
+                }
+                delete done;
+            }
+            batch.clear();
+        }
+    }
+
+    /**
+    * Classify the boards of a batch together, one classifier call per distinct context
+    */
+    void ParsePipeline::classifyBatch(vector<Job*> &batch) {
+        vector<bool> classified(batch.size(), false);
+        for (size_t first = 0; first < batch.size(); first++) {
+            if (classified[first]) {
+                continue;
+            }
+            const ParseContext * context = batch[first]->context.get();
+            vector<size_t> members;
+            vector<ParseRequest> requests;
+            vector<BoardDigits> boards;
+            for (size_t j = first; j < batch.size(); j++) {
+                if (!classified[j] && batch[j]->context.get() == context) {
+                    classified[j] = true;
+                    members.push_back(j);
+                    requests.push_back(batch[j]->request);
+                    boards.push_back(batch[j]->board);
+                }
+            }
+
+            try {
+                internalClassifyBoards(requests, boards, false, context);
+                for (size_t m = 0; m < members.size(); m++) {
+                    batch[members[m]]->request.error = requests[m].error;
+                }
+            } catch (...) {
+                for (size_t m : members) {
+                    if (!batch[m]->request.error) {
+                        fail(batch[m]->request);
+                    }
+                }
+            }
+        }
+        SUDOKU_LOG_DEBUG("classified pipeline batch", {{"boards", batch.size()}});
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef  PARSE_PIPELINE_INC
+#define  PARSE_PIPELINE_INC
+
+#include "ring_buffer.hpp"
+#include "sudoku_parser.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Sudoku {
+    /**
+    * Threads given to each stage of a ParsePipeline and the capacity of the queue feeding each stage
+    */
+    struct PipelineConfig {
+        size_t decodeThreads;
+        size_t detectThreads;
+        size_t classifyThreads;
+        size_t queueCapacity;
+        size_t maxBatch;        // boards whose digits the classify stage classifies at once
+    };
+
+    // Images waiting in front of each stage
+    struct PipelineDepths {
+        size_t decode;
+        size_t detect;
+        size_t classify;
+    };
+
+    /**
+    * Parses a stream of images in three stages - decode, grid detection and cleaning, and batched
+    * classification - each on its own threads and connected by lock-free RingBuffers, so consecutive
+    * images overlap and the classifier sees the digits of several boards at once.
+    * Idle stages sleep until their queue fills or closes; destruction completes every queued parse
+    */
+    class ParsePipeline {
+    public:
+        // Invoked on a classify thread with the filled result and the error, if any, that ended the parse
+        using Completion = std::function<void(SudokuParseResult &result, std::exception_ptr error)>;
+
+        explicit ParsePipeline(const PipelineConfig &config);
+        ~ParsePipeline();
+
+        ParsePipeline(const ParsePipeline&) = delete;
+        ParsePipeline& operator=(const ParsePipeline&) = delete;
+
+        /**
+        * Queue an image, taking ownership of data.  corners may be NULL or the 8 gridPoints to warp without
+        * searching for the grid, and a NULL context parses with DefaultParseContext().
+        * Returns false without queueing if the first stage is full and block is false, or once the pipeline is closing
+        */
+        bool submit(std::shared_ptr<std::vector<char> > data, const float * corners,
+                    std::shared_ptr<const ParseContext> context, Completion completion, bool block);
+
+        // Images the decode stage queues before submit waits or, without block, is refused
+        size_t capacity() const;
+
+        PipelineDepths depths() const;
+
+        const PipelineConfig& config() const { return settings; }
+
+    private:
+        struct Job;
+
+        /**
+        * RingBuffer feeding a stage whose producers wait for room and consumers for a job on condition
+        * variables.  Pushes and pops stay lock-free; the mutex is taken only to wait, or to wake a thread
+        * counted as waiting
+        */
+        class StageQueue {
+        public:
+            explicit StageQueue(size_t capacity) : ring(capacity), closed(false), emptyWaiters(0), fullWaiters(0) {}
+
+            // Waits for room, returning false without queueing job once the queue is closed
+            bool push(Job * job);
+            bool tryPush(Job * job);
+            // Waits for a job, returning false once the queue is closed and drained
+            bool pop(Job *& job);
+            bool tryPop(Job *& job);
+            // Called once no more jobs will be pushed
+            void close();
+
+            size_t size() const { return ring.size(); }
+            size_t capacity() const { return ring.capacity(); }
+
+        private:
+            void wake(std::condition_variable &condition, const std::atomic<int> &waiters);
+
+            RingBuffer<Job*> ring;
+            std::mutex waitMutex;
+            std::condition_variable notEmpty;
+            std::condition_variable notFull;
+            std::atomic<bool> closed;
+            // threads waiting on notEmpty and notFull, changed only with waitMutex held
+            std::atomic<int> emptyWaiters;
+            std::atomic<int> fullWaiters;
+        };
+
+        void decodeStage();
+        void detectStage();
+        void classifyStage();
+        void classifyBatch(std::vector<Job*> &batch);
+        void forward(StageQueue &queue, Job * job);
+
+        PipelineConfig settings;
+        // each is closed once every thread of the stage before has exited so a stage can finish after draining it
+        StageQueue decodeQueue;
+        StageQueue detectQueue;
+        StageQueue classifyQueue;
+        std::vector<std::thread> decodeThreads;
+        std::vector<std::thread> detectThreads;
+        std::vector<std::thread> classifyThreads;
+    };
+
+    // One decode and classify thread with the remaining cores detecting, 4 queued images per thread and batches of 8
+    PipelineConfig DefaultPipelineConfig();
+}
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef  RING_BUFFER_INC
+#define  RING_BUFFER_INC
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Sudoku {
+    /**
+    * Bounded lock-free multi-producer/multi-consumer queue (Vyukov's sequenced ring).
+    * Capacity is rounded up to a power of two; tryPush and tryPop never block
+    */
+    template<typename T>
+    class RingBuffer {
+    public:
+        explicit RingBuffer(size_t minCapacity) : slots(roundUpPowerOfTwo(minCapacity)), mask(slots.size() - 1),
+                                                  enqueuePos(0), dequeuePos(0) {
+            for (size_t i = 0; i < slots.size(); i++) {
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        RingBuffer(const RingBuffer&) = delete;
+        RingBuffer& operator=(const RingBuffer&) = delete;
+
+        // Returns false without copying item when the ring is full
+        bool tryPush(const T &item) {
+            size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            for (;;) {
+                Slot &slot = slots[pos & mask];
+                size_t sequence = slot.sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+                if (diff == 0) {
+                    if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        slot.item = item;
+                        slot.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Returns false when the ring is empty
+        bool tryPop(T &item) {
+            size_t pos = dequeuePos.load(std::memory_order_relaxed);
+            for (;;) {
+                Slot &slot = slots[pos & mask];
+                size_t sequence = slot.sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+                if (diff == 0) {
+                    if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        item = std::move(slot.item);
+                        slot.sequence.store(pos + mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = dequeuePos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        size_t capacity() const { return slots.size(); }
+
+        // Approximate number of queued items; exact only while no other thread is pushing or popping
+        size_t size() const {
+            size_t enqueued = enqueuePos.load(std::memory_order_relaxed);
+            size_t dequeued = dequeuePos.load(std::memory_order_relaxed);
+            return enqueued > dequeued ? enqueued - dequeued : 0;
+        }
+
+    private:
+        struct Slot {
+            std::atomic<size_t> sequence;
+            T item;
+        };
+
+        static size_t roundUpPowerOfTwo(size_t value) {
+            size_t capacity = 2;
+            while (capacity < value) {
+                capacity <<= 1;
+            }
+            return capacity;
+        }
+
+        std::vector<Slot> slots;
+        const size_t mask;
+        // keep producer and consumer positions on separate cache lines
+        alignas(64) std::atomic<size_t> enqueuePos;
+        alignas(64) std::atomic<size_t> dequeuePos;
+    };
+}
+
+#endif
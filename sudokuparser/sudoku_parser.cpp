@@ -1,7 +1,12 @@
 #include "detect_digits.hpp"
 #include "identify_digits.hpp"
 #include "sudoku_parser.hpp"
+#include "logging.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
 #include <string>
 #include <tuple>
 #include <iostream>
@@ -14,29 +19,215 @@ using namespace std;
 using namespace cv;
 
 const char *SVM_MODEL_ENV_VAR_NAME = "GO_SUDOKU_SVM_MODEL";
+const char *CASCADE_THRESHOLD_ENV_VAR_NAME = "GO_SUDOKU_CASCADE_THRESHOLD";
+const char *SCREEN_CLASSIFIER_ENV_VAR_NAME = "GO_SUDOKU_SCREEN_CLASSIFIER";
+const char *SCREEN_THRESHOLD_ENV_VAR_NAME = "GO_SUDOKU_SCREEN_THRESHOLD";
+
+// Cells classified with at least this confidence skip despeckling and deskewing.
+// GO_SUDOKU_CASCADE_THRESHOLD outside [0, 1] is ignored in favour of it
+const float DEFAULT_CASCADE_THRESHOLD = 0.85f;
+
+/**
+* Threshold in [0, 1] named by the environment variable envVar, or fallback when it is unset or malformed;
+* a malformed value would otherwise read as 0 or NaN and silently change how cells are classified
+*/
+static float thresholdFromEnv(const char * envVar, float fallback) {
+    const char * val = getenv(envVar);
+    if (val == NULL) {
+        return fallback;
+    }
+    char * end;
+    float threshold = strtof(val, &end);
+    if (end == val || *end != '\0' || !(threshold >= 0 && threshold <= 1)) {
+        SUDOKU_LOG_WARN("ignoring invalid threshold", {{"variable", envVar}, {"value", val}});
+        return fallback;
+    }
+    return threshold;
+}
+
+// Read from the environment once, on first use, so parses never call getenv while setenv may be running
+static atomic<float>& cascadeThreshold() {
+    static atomic<float> threshold(thresholdFromEnv(CASCADE_THRESHOLD_ENV_VAR_NAME, DEFAULT_CASCADE_THRESHOLD));
+    return threshold;
+}
+
+float DefaultCascadeThreshold() {
+    return cascadeThreshold().load(memory_order_relaxed);
+}
+
+bool SetDefaultCascadeThreshold(float threshold) {
+    if (!(threshold >= 0 && threshold <= 1)) {
+        return false;
+    }
+    cascadeThreshold().store(threshold, memory_order_relaxed);
+    return true;
+}
+
+// Screened cells accepted without consulting the SVM
+const float DEFAULT_SCREEN_THRESHOLD = 0.9f;
+
+// Screen backend in front of the default SVM; published whole so a parse never sees half of a change
+struct ScreenSettings {
+    shared_ptr<const DigitClassifier> screen;
+    float threshold;
+};
+static shared_ptr<const ScreenSettings> screenSettings;   // NULL while screening is off
+static once_flag screenSettingsRead;
+
+/**
+* Screen named by GO_SUDOKU_SCREEN_CLASSIFIER and GO_SUDOKU_SCREEN_THRESHOLD, read once on first use so
+* parses never call getenv while setenv may be running
+*/
+static shared_ptr<const ScreenSettings> currentScreenSettings() {
+    call_once(screenSettingsRead, [] {
+        const char * backend = getenv(SCREEN_CLASSIFIER_ENV_VAR_NAME);
+        if (backend == NULL || *backend == '\0') {
+            return;
+        }
+        try {
+            auto settings = make_shared<ScreenSettings>();
+            settings->screen = CreateDigitClassifier(backend, "");
+            settings->threshold = thresholdFromEnv(SCREEN_THRESHOLD_ENV_VAR_NAME, DEFAULT_SCREEN_THRESHOLD);
+            atomic_store(&screenSettings, shared_ptr<const ScreenSettings>(settings));
+        } catch (const std::exception& e) {
+            SUDOKU_LOG_WARN("ignoring screen classifier", {{"backend", backend}, {"error", e.what()}});
+        }
+    });
+    return atomic_load(&screenSettings);
+}
+
+bool SetDefaultScreenClassifier(const string &backend, float threshold) {
+    if (!(threshold >= 0 && threshold <= 1)) {
+        return false;
+    }
+    // settle the environment's settings first so they cannot replace these later
+    currentScreenSettings();
+    shared_ptr<ScreenSettings> settings;
+    if (!backend.empty()) {
+        settings = make_shared<ScreenSettings>();
+        settings->screen = CreateDigitClassifier(backend, "");
+        settings->threshold = threshold;
+    }
+    atomic_store(&screenSettings, shared_ptr<const ScreenSettings>(settings));
+    return true;
+}
+
+// Screened default classifier along with the screen settings and model generation it was built for
+struct ScreenedDefault {
+    shared_ptr<const ScreenSettings> settings;
+    unsigned long generation;   // of the published model screened
+    shared_ptr<const DigitClassifier> classifier;
+};
+static shared_ptr<const ScreenedDefault> screenedDefault;
+static mutex screenMutex;
+
+/**
+* Snapshot of the default SVM, screened by the backend set with SetDefaultScreenClassifier, if any.
+* The screened classifier is rebuilt only when the screen settings change or a new model is published
+*/
+static shared_ptr<const DigitClassifier> defaultClassifier() {
+    // the model and its generation come from one snapshot so the cache is never keyed to a model it doesn't hold
+    PublishedClassifier full = PublishedDigitClassifier();
+    shared_ptr<const ScreenSettings> settings = currentScreenSettings();
+    if (!settings) {
+        return full.classifier;
+    }
 
-const string internalParseSudoku(const char * encImgData, int length, float * gridPoints, bool saveOutput) {
-    std::vector<char> encodedImageData(encImgData, encImgData + length);
+    // a cache built from a newer model than this snapshot is just as good, and is not replaced with an older one
+    shared_ptr<const ScreenedDefault> current = atomic_load(&screenedDefault);
+    if (current && current->settings == settings && current->generation >= full.generation) {
+        return current->classifier;
+    }
 
-    Mat sudokuBoard = imdecode(encodedImageData, CV_LOAD_IMAGE_ANYDEPTH);
-    cout << "channels: " << sudokuBoard.channels() << " type: " << sudokuBoard.type() << endl;
+    lock_guard<mutex> lock(screenMutex);
+    current = atomic_load(&screenedDefault);
+    if (!current || current->settings != settings || current->generation < full.generation) {
+        auto rebuilt = make_shared<ScreenedDefault>();
+        rebuilt->settings = settings;
+        rebuilt->generation = full.generation;
+        rebuilt->classifier = CreateScreenedDigitClassifier(settings->screen, full.classifier, settings->threshold);
+        atomic_store(&screenedDefault, shared_ptr<const ScreenedDefault>(rebuilt));
+        current = rebuilt;
+    }
+    return current->classifier;
+}
+
+ParseContext DefaultParseContext() {
+    ParseContext context;
+    context.classifier = defaultClassifier();
+    context.cascadeThreshold = DefaultCascadeThreshold();
+    return context;
+}
+
+static float elapsedMs(chrono::steady_clock::time_point start) {
+    return chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+* Reset result to an empty puzzle, keeping any grid corners supplied by the caller
+*/
+void internalClearResult(SudokuParseResult * result) {
+    result->status = SUDOKU_PARSE_ERROR;
+    fill(result->puzzle, result->puzzle + 81, '.');
+    result->puzzle[81] = '\0';
+    fill(result->values, result->values + 81, 0);
+    fill(result->confidences, result->confidences + 81, 0.0f);
+    fill(result->stages, result->stages + 81, static_cast<int>(STAGE_EMPTY));
+    memset(result->boxes, 0, sizeof(result->boxes));
+    result->gridWidth = 0;
+    result->gridHeight = 0;
+    memset(&result->timings, 0, sizeof(result->timings));
+    memset(&result->memory, 0, sizeof(result->memory));
+}
+
+Mat internalDecodeBoard(const ParseRequest &request) {
+    auto start = chrono::steady_clock::now();
+    Mat sudokuBoard = imdecode(Mat(1, request.length, CV_8UC1, const_cast<char *>(request.encodedImageData)), CV_LOAD_IMAGE_ANYDEPTH);
+    SUDOKU_LOG_DEBUG("decoded image", {{"channels", sudokuBoard.channels()}, {"type", sudokuBoard.type()}});
     if (sudokuBoard.type() == 2) {
         sudokuBoard.convertTo(sudokuBoard, CV_8U, 0.00390625);
     }
-    
-    Mat cleanedBoard;
-    vector<float> gPoints;
-    float scale = 1.0;
-    vector<Rect> digits = FindDigitRects(sudokuBoard, cleanedBoard, gPoints, scale);
+    request.result->timings.decodeMs = elapsedMs(start);
+    return sudokuBoard;
+}
 
+void internalDetectBoard(const ParseRequest &request, const Mat &sudokuBoard, BoardDigits &board) {
+    // gridPoints arriving without any -1 entry are corners from an earlier parse or the caller
+    const float * gridPoints = request.result->gridPoints;
+    bool cornersGiven = true;
+    for (int i = 0; cornersGiven && i < 8; i++) {
+        cornersGiven = gridPoints[i] >= 0;
+    }
 
-    map<string, int> digitMap;
+    auto start = chrono::steady_clock::now();
+    board.scale = 1.0;
+    board.digits = FindDigitRects(sudokuBoard, board.cleaned, board.gridPoints, board.scale,
+                                  cornersGiven ? gridPoints : NULL);
 
-    if (digits.size() > 0) {
+    if (board.digits.size() > 0) {
         // get the bounding box of all digits
-        Rect allDigits = digits[0];
-        for( size_t i = 0; i< digits.size(); i++ ) { allDigits |= digits[i]; }
-        if (gPoints.size() == 0) {
+        board.allDigits = board.digits[0];
+        for( size_t i = 0; i< board.digits.size(); i++ ) { board.allDigits |= board.digits[i]; }
+    }
+    request.result->timings.detectMs = elapsedMs(start);
+}
+
+/**
+* Map classified digits back to their cells, filling the result in place
+*/
+static void assemblePuzzle(ParseRequest &request, const BoardDigits &board, const vector<int> &identified,
+                           const vector<float> &cellConfidences, const vector<CascadeStage> &cellStages, bool saveOutput) {
+    const vector<Rect> &digits = board.digits;
+    const Rect &allDigits = board.allDigits;
+    SudokuParseResult * result = request.result;
+    float * gridPoints = result->gridPoints;
+
+    result->gridWidth = board.cleaned.cols;
+    result->gridHeight = board.cleaned.rows;
+
+    if (digits.size() > 0) {
+        float scale = board.scale;
+        if (board.gridPoints.size() == 0) {
             gridPoints[0] = allDigits.x * scale;
             gridPoints[1] = allDigits.y * scale;
             gridPoints[2] = (allDigits.x + allDigits.width) * scale;
@@ -50,64 +241,219 @@ const string internalParseSudoku(const char * encImgData, int length, float * gr
         double cellWidth = allDigits.width / 9.0;
         double cellHeight = allDigits.height / 9.0;
 
-        Mat digitBounds = cleanedBoard.clone();
+        Mat digitBounds;
         Scalar pink = Scalar(255, 105, 180);
         Scalar teal = Scalar(20, 135, 128);
         if (saveOutput) {
-            cvtColor( digitBounds, digitBounds, COLOR_GRAY2BGR );
+            cvtColor( board.cleaned, digitBounds, COLOR_GRAY2BGR );
         }
 
         for( size_t i = 0; i< digits.size(); i++ )
         {
             Point center = (digits[i].br() + digits[i].tl())*0.5;
-            int row = int(floor((center.y - allDigits.y) / cellHeight));
-            char rowChar = "ABCDEFGHI"[row];
-            int col = int(floor((center.x - allDigits.x) / cellWidth));
+            int row = min(8, int(floor((center.y - allDigits.y) / cellHeight)));
+            int col = min(8, int(floor((center.x - allDigits.x) / cellWidth)));
+            int cell = (row * 9) + col;
 
-            // save the digit
-            Mat digitImg = Mat(cleanedBoard, digits[i]);
-            resize(digitImg, digitImg, Size(EXPORT_DIGIT_SIZE, EXPORT_DIGIT_SIZE), 0, 0, CV_INTER_AREA);
-            // despeckle
-            fastNlMeansDenoising(digitImg, digitImg, 50.0, 5, cleanedBoard.cols / 10);
-
-            int digit = IdentifyDigit(digitImg);
+            int tile = board.firstTile + static_cast<int>(i);
+            int digit = identified[tile];
 
             if (saveOutput) {
                 rectangle( digitBounds, digits[i], pink, 1, 8, 0 );
                 putText(digitBounds, to_string(digit), center + Point(5, 12), FONT_HERSHEY_PLAIN, 0.8, teal);
             }
-            
-            digitMap[string(1, rowChar) + to_string(col + 1)] = digit;
+
+            result->values[cell] = static_cast<unsigned char>(digit);
+            result->puzzle[cell] = static_cast<char>('0' + digit);
+            result->confidences[cell] = cellConfidences[tile];
+            result->stages[cell] = cellStages[tile];
+            result->boxes[cell].x = digits[i].x;
+            result->boxes[cell].y = digits[i].y;
+            result->boxes[cell].width = digits[i].width;
+            result->boxes[cell].height = digits[i].height;
         }
         
-        rectangle( digitBounds, allDigits, teal, 1, 8, 0 );
         #ifdef VERBOSE
-        imwrite("artifact_07_detected.png", digitBounds);
+        if (saveOutput) {
+            rectangle( digitBounds, allDigits, teal, 1, 8, 0 );
+            imwrite("artifact_07_detected.png", digitBounds);
+        }
         #endif
     }
 
-    string puzzle = "";
-    for (int y = 0; y < 9; y++ ) {
-        for (int x = 0; x < 9; x++) {
-            string key = string(1, "ABCDEFGHI"[y]) + to_string(x + 1);
-            auto search = digitMap.find(key);
-            if(search != digitMap.end()) {
-                puzzle += to_string(search->second);
-            } else {
-                puzzle += ".";
-            }
-            
+    SUDOKU_LOG_DEBUG("puzzle parsed", {{"bytes", request.length}, {"puzzle", result->puzzle}});
+
+    // set the grid corners
+    if (board.gridPoints.size() == 8) {
+        copy(board.gridPoints.begin(), board.gridPoints.end(), gridPoints);
+    }
+
+    result->status = SUDOKU_PARSE_OK;
+}
+
+void internalClassifyBoards(vector<ParseRequest> &requests, vector<BoardDigits> &boards, bool saveOutput, const ParseContext * context) {
+    int tileCount = 0;
+    for (BoardDigits &board : boards) {
+        board.firstTile = tileCount;
+        tileCount += static_cast<int>(board.digits.size());
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    // resize the digits of every board into one contiguous atlas of square tiles so they are classified as a batch
+    Mat atlas(tileCount * EXPORT_DIGIT_SIZE, EXPORT_DIGIT_SIZE, CV_8UC1);
+    vector<int> denoiseWindows(tileCount);
+    for (const BoardDigits &board : boards) {
+        for( size_t i = 0; i< board.digits.size(); i++ )
+        {
+            int index = board.firstTile + static_cast<int>(i);
+            Mat tile = atlas.rowRange(index * EXPORT_DIGIT_SIZE, (index + 1) * EXPORT_DIGIT_SIZE);
+            resize(Mat(board.cleaned, board.digits[i]), tile, tile.size(), 0, 0, CV_INTER_AREA);
+            denoiseWindows[index] = board.cleaned.cols / 10;
         }
     }
-    
-    cout << length << " byte puzzle parsed as " << puzzle << endl;
 
-    // set the grid corners
-    if (gPoints.size() == 8) {
-        copy(gPoints.begin(), gPoints.end(), gridPoints);
+    vector<int> identified;
+    vector<float> cellConfidences;
+    vector<CascadeStage> cellStages;
+    ParseContext defaults;
+    if (!context) {
+        defaults = DefaultParseContext();
+        context = &defaults;
+    }
+    // one snapshot of the published model for the whole batch, even if a newer one is published meanwhile
+    shared_ptr<const DigitClassifier> classifier = context->classifier ? context->classifier : defaultClassifier();
+    CascadeIdentifyDigits(*classifier, atlas, denoiseWindows, context->cascadeThreshold,
+                          identified, cellConfidences, cellStages);
+    float classifyMs = elapsedMs(start);
+
+    for (size_t b = 0; b < requests.size(); b++) {
+        if (requests[b].error) {
+            continue;
+        }
+        try {
+            assemblePuzzle(requests[b], boards[b], identified, cellConfidences, cellStages, saveOutput);
+        } catch (...) {
+            requests[b].error = current_exception();
+        }
+        // classification is shared by the whole batch
+        SudokuParseTimings &timings = requests[b].result->timings;
+        timings.classifyMs = classifyMs;
+        timings.totalMs = timings.decodeMs + timings.detectMs + timings.classifyMs;
     }
+}
 
-    return puzzle;
+bool IsNoGridError(exception_ptr error) {
+    if (!error) {
+        return false;
+    }
+    try {
+        rethrow_exception(error);
+    } catch (const NoGridError&) {
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+void internalRecordMemory(SudokuParseResult * result, const MemoryAccount &account) {
+    MemoryUsage usage = account.usage();
+    result->memory.allocatedBytes = static_cast<long long>(usage.allocatedBytes);
+    result->memory.peakBytes = static_cast<long long>(usage.peakBytes);
+    SUDOKU_LOG_DEBUG("parse memory", {{"allocated", usage.allocatedBytes}, {"peak", usage.peakBytes}});
+}
+
+void internalParseSudokuBatch(vector<ParseRequest> &requests, bool saveOutput, const ParseContext * context) {
+    vector<BoardDigits> boards(requests.size());
+    vector<MemoryAccount> accounts(requests.size());
+    for (size_t b = 0; b < requests.size(); b++) {
+        internalClearResult(requests[b].result);
+        MemoryScope scope(accounts[b]);
+        try {
+            internalDetectBoard(requests[b], internalDecodeBoard(requests[b]), boards[b]);
+        } catch (...) {
+            requests[b].error = current_exception();
+            requests[b].result->status = IsNoGridError(requests[b].error) ? SUDOKU_PARSE_NO_GRID : SUDOKU_PARSE_ERROR;
+            boards[b].digits.clear();
+        }
+        internalRecordMemory(requests[b].result, accounts[b]);
+    }
+
+    internalClassifyBoards(requests, boards, saveOutput, context);
+}
+
+vector<PagePuzzle> internalParseSudokuPage(const char * encodedImageData, int length, const ParseContext * context) {
+    MemoryAccount account;
+    MemoryScope scope(account);
+    auto start = chrono::steady_clock::now();
+    Mat page = imdecode(Mat(1, length, CV_8UC1, const_cast<char *>(encodedImageData)), CV_LOAD_IMAGE_ANYDEPTH);
+    if (page.type() == 2) {
+        page.convertTo(page, CV_8U, 0.00390625);
+    }
+    float decodeMs = elapsedMs(start);
+
+    start = chrono::steady_clock::now();
+    vector<PageGrid> grids = FindPageGrids(page);
+    float detectMs = elapsedMs(start);
+
+    vector<PagePuzzle> puzzles(grids.size());
+    vector<ParseRequest> requests(grids.size());
+    vector<BoardDigits> boards(grids.size());
+    for (size_t g = 0; g < grids.size(); g++) {
+        SudokuParseResult * result = &puzzles[g].result;
+        internalClearResult(result);
+        copy(grids[g].gridPoints.begin(), grids[g].gridPoints.end(), result->gridPoints);
+        // grids are found together so each reports the whole page's decode and detection time
+        result->timings.decodeMs = decodeMs;
+        result->timings.detectMs = detectMs;
+
+        requests[g].encodedImageData = encodedImageData;
+        requests[g].length = length;
+        requests[g].result = result;
+
+        // grid corners are already in page pixels
+        boards[g].cleaned = grids[g].cleaned;
+        boards[g].digits = grids[g].digits;
+        boards[g].gridPoints = grids[g].gridPoints;
+        boards[g].scale = 1.0;
+        if (boards[g].digits.size() > 0) {
+            boards[g].allDigits = boards[g].digits[0];
+            for (const Rect &digit : boards[g].digits) { boards[g].allDigits |= digit; }
+        }
+    }
+
+    internalClassifyBoards(requests, boards, false, context);
+    for (size_t g = 0; g < grids.size(); g++) {
+        puzzles[g].error = requests[g].error;
+        internalRecordMemory(&puzzles[g].result, account);
+    }
+    SUDOKU_LOG_DEBUG("page parsed", {{"bytes", length}, {"puzzles", puzzles.size()}});
+    return puzzles;
+}
+
+void internalParseSudokuInto(const char * encodedImageData, int length, SudokuParseResult * result, bool saveOutput,
+                             const ParseContext * context) {
+    vector<ParseRequest> requests(1);
+    requests[0].encodedImageData = encodedImageData;
+    requests[0].length = length;
+    requests[0].result = result;
+
+    internalParseSudokuBatch(requests, saveOutput, context);
+    if (requests[0].error) {
+        rethrow_exception(requests[0].error);
+    }
+}
+
+const string internalParseSudoku(const char * encImgData, int length, float * gridPoints, bool saveOutput,
+                                 float * confidences, int * stages, const ParseContext * context) {
+    SudokuParseResult result;
+    copy(gridPoints, gridPoints + 8, result.gridPoints);
+    internalParseSudokuInto(encImgData, length, &result, saveOutput, context);
+
+    copy(result.gridPoints, result.gridPoints + 8, gridPoints);
+    if (confidences) { copy(result.confidences, result.confidences + 81, confidences); }
+    if (stages) { copy(result.stages, result.stages + 81, stages); }
+    return string(result.puzzle);
 }
 
 // https://stackoverflow.com/a/9676623/385152
@@ -137,7 +483,7 @@ map<string, string> parseTrainConfig(const char * trainConfigFile) {
         if (v.size() == 2) {
             trainFiles[v[0]] = v[1];
         } else {
-            cout << "Discarding line with unexpected number of tokens: " << line << endl;
+            SUDOKU_LOG_WARN("discarding line with unexpected number of tokens", {{"line", line}});
         }
     }
     return trainFiles;
@@ -213,11 +559,11 @@ string internalTrainSudoku(const char * trainConfigFile) {
                     allLabeledDigits[el.first].push_back(digit);
             }
             //imshow(file, cleanedBoard);
-            cout << "captured " << labeledDigits.size() << " digits from " << element.first << endl;
+            SUDOKU_LOG_INFO("captured digits", {{"labels", labeledDigits.size()}, {"file", element.first}});
         } catch (const std::exception& e) {
-            cout << "Exception occurred while processing " << element.first << ": " << e.what() << endl;
+            SUDOKU_LOG_ERROR("exception occurred while processing", {{"file", element.first}, {"error", e.what()}});
         } catch (...) {
-            cout << "Exception occurred while processing " << element.first << endl;
+            SUDOKU_LOG_ERROR("exception occurred while processing", {{"file", element.first}});
         }
     }
 
@@ -246,7 +592,13 @@ string internalTrainSudoku(const char * trainConfigFile) {
         setenv(SVM_MODEL_ENV_VAR_NAME, "model4.yml", 0);
     }
 
-    // Train the SVM
-    return TrainSVM("combined.png", EXPORT_DIGIT_SIZE);
+    // Train the SVM and publish it to parses started from now on
+    string accuracy = TrainSVM("combined.png", EXPORT_DIGIT_SIZE);
+    try {
+        ReloadDigitClassifier("");
+    } catch (const std::exception& e) {
+        SUDOKU_LOG_ERROR("could not publish trained model", {{"error", e.what()}});
+    }
+    return accuracy;
 }
 
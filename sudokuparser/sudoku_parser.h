@@ -11,11 +11,178 @@ extern "C" {
     // Define methods to be exposed to Go here
 
     extern const char *SVM_MODEL_VAR;
+    extern const char *CASCADE_THRESHOLD_VAR;
+    extern const char *SCREEN_CLASSIFIER_VAR;
+    extern const char *SCREEN_THRESHOLD_VAR;
 
-    void ParseSudoku(const char * encodedImageData, int length, float * gridPoints, bool saveOutput, char * parsed);
+    // confidences and stages are optional 81 entry arrays receiving per-cell classification details.
+    // gridPoints filled with the 4 corners of the grid, rather than -1, skips grid detection
+    void ParseSudoku(const char * encodedImageData, int length, float * gridPoints, bool saveOutput, char * parsed,
+                     float * confidences, int * stages);
 
     const char* TrainSudoku(const char * trainConfigFile);
 
+    // Asynchronous parsing on a fixed pool of C++ workers fed by a bounded queue
+
+    typedef enum {
+        SUDOKU_PARSE_OK = 0,
+        SUDOKU_PARSE_ERROR = 1,
+        SUDOKU_PARSE_NO_GRID = 2    // rejected by the quick grid check before a full parse
+    } SudokuParseStatus;
+
+    // Bounding box of a digit in the flattened grid image
+    typedef struct {
+        int x;
+        int y;
+        int width;
+        int height;
+    } SudokuCellBox;
+
+    // Milliseconds spent in each step of a parse; classification is shared by all grids parsed together
+    typedef struct {
+        float decodeMs;
+        float detectMs;
+        float classifyMs;
+        float totalMs;
+    } SudokuParseTimings;
+
+    // Bytes of OpenCV image data allocated while decoding an image, finding its grid and cleaning it.
+    // The digit atlas shared by the images classified together is left out, while page results
+    // report the whole page
+    typedef struct {
+        long long allocatedBytes;   // including buffers freed before the parse finished
+        long long peakBytes;        // most held at once
+    } SudokuMemoryUsage;
+
+    // Fixed size, filled in place by the parse so results can be reused without allocating.
+    // Cells are row major; empty cells have value 0, '.' in puzzle and a zero box
+    typedef struct {
+        int status;
+        char puzzle[82];
+        unsigned char values[81];
+        float gridPoints[8];
+        float confidences[81];
+        int stages[81];
+        SudokuCellBox boxes[81];
+        int gridWidth;              // size of the flattened grid the boxes are in
+        int gridHeight;
+        SudokuParseTimings timings;
+        SudokuMemoryUsage memory;
+    } SudokuParseResult;
+
+    typedef long long SudokuTicket;
+
+    // Returned by SubmitParseSudoku instead of a ticket when the queue is full and block is false
+    #define SUDOKU_QUEUE_FULL -1
+
+    // Invoked on an executor thread; result is only valid for the duration of the call
+    typedef void (*SudokuParseCallback)(SudokuTicket ticket, SudokuParseResult * result, void * userData);
+
+    // Size the executor before the first submission; returns false once it has started
+    bool ConfigureParseExecutor(int workers, int queueCapacity);
+
+    // Parses admitted at once before a further submit waits: those queued or running on the executor,
+    // or those queued in front of the first stage of a pipeline
+    int ParseExecutorCapacity(void);
+
+    typedef enum {
+        SUDOKU_THREADING_DEFAULT = 0,       // one worker per core, OpenCV threading untouched
+        SUDOKU_THREADING_INTRA_IMAGE = 1,   // one parse at a time using every core inside OpenCV
+        SUDOKU_THREADING_INTER_IMAGE = 2    // one single-threaded parse per core
+    } SudokuThreadingPolicy;
+
+    // Choose how cores are shared between concurrent parses and OpenCV's parallel loops, optionally
+    // pinning each worker to a core.  OpenCV's thread count is process wide so this is global rather
+    // than per context.  Replaces a running executor after draining it, so call it with no parses in flight
+    void ConfigureParseThreading(int policy, bool pinWorkers);
+
+    // Threads per stage of the pipelined engine and the capacity of the queue in front of each stage;
+    // zero fields take the defaults
+    typedef struct {
+        int decodeThreads;
+        int detectThreads;      // grid detection, cleaning and line removal
+        int classifyThreads;
+        int queueCapacity;
+        int maxBatch;           // boards whose digits are classified together
+    } SudokuPipelineConfig;
+
+    // Images waiting in front of each pipeline stage
+    typedef struct {
+        int decode;
+        int detect;
+        int classify;
+    } SudokuPipelineDepths;
+
+    // Run submissions through separate decode, detection and classification stages so consecutive
+    // images overlap, rather than parsing each one start to finish on an executor worker.  NULL goes
+    // back to the executor.  Replaces a running pipeline after completing its queued parses
+    void ConfigureParsePipeline(const SudokuPipelineConfig * config);
+
+    // Zeros when no pipeline is configured
+    void ParsePipelineDepths(SudokuPipelineDepths * depths);
+
+    // OpenCV image data held across the process, counted once the first parse has started
+    typedef struct {
+        long long liveBytes;
+        long long peakLiveBytes;
+        long long peakParseBytes;   // largest peakBytes of any parse so far
+    } SudokuMemoryTotals;
+
+    void ParseMemoryTotals(SudokuMemoryTotals * totals);
+
+    // Start accounting the memory of parses made directly on the caller's threads; call it before any
+    // parse begins.  Parses through the executor or pipeline are accounted regardless
+    void EnableParseMemoryAccounting(void);
+
+    // Cascade threshold of parses without their own context, initially GO_SUDOKU_CASCADE_THRESHOLD or 0.85.
+    // Safe while parses are running; returns false, changing nothing, outside [0, 1]
+    bool SetParseCascadeThreshold(float threshold);
+
+    // Screen parses without their own context with backend, such as "linear-int8", passing cells scored below
+    // threshold to the SVM; an empty backend turns screening off.  Initially GO_SUDOKU_SCREEN_CLASSIFIER and
+    // GO_SUDOKU_SCREEN_THRESHOLD.  Safe while parses are running; returns false, changing nothing, for a threshold
+    // outside [0, 1] or a backend that cannot be loaded
+    bool SetParseScreenClassifier(const char * backend, float threshold);
+
+    // Classifier backend and cascade settings shared by the parses submitted with it
+    typedef struct SudokuContext SudokuContext;
+
+    // backend is "svm", "cnn", "linear" or "centroid" (optionally suffixed "-int16" or "-int8"); an empty modelPath falls back to the backend's environment variable
+    // and a negative cascadeThreshold to the one set with SetParseCascadeThreshold.  Returns NULL when the model cannot be loaded
+    SudokuContext * CreateSudokuContext(const char * backend, const char * modelPath, float cascadeThreshold);
+
+    // Parses already submitted with the context still complete with it
+    void FreeSudokuContext(SudokuContext * context);
+
+    // Load the SVM at modelPath, or GO_SUDOKU_SVM_MODEL when NULL or empty, and publish it to parses using the
+    // default SVM, including contexts created for "svm" without a modelPath.  Parses in flight finish with the
+    // model they started with.  TrainSudoku publishes the model it trains the same way.  Returns the new model
+    // generation, or -1 leaving the current model in place when the file cannot be loaded
+    long long ReloadSudokuModel(const char * modelPath);
+
+    // Number of default models published so far
+    long long SudokuModelGeneration(void);
+
+    // Copies the image data and queues it for parsing with context, or the default SVM context
+    // when NULL.  corners optionally holds the 8 gridPoints of an earlier parse, possibly adjusted,
+    // to warp without searching for the grid.  Without a callback the result is held until
+    // retrieved with PollParseSudoku
+    SudokuTicket SubmitParseSudoku(const SudokuContext * context, const char * encodedImageData, int length,
+                                   const float * corners, bool block, SudokuParseCallback callback, void * userData);
+
+    // Returns 1 and fills result once complete, 0 while pending and -1 for an unknown ticket
+    int PollParseSudoku(SudokuTicket ticket, SudokuParseResult * result);
+
+    // Find every puzzle grid on a page image, such as a newspaper or puzzle book scan, and parse them
+    // in parallel.  Fills results top to bottom, then left to right, for up to maxResults grids and
+    // returns the number of grids found; corners are in page pixels.  Runs on the calling thread
+    int ParseSudokuPage(const SudokuContext * context, const char * encodedImageData, int length,
+                        SudokuParseResult * results, int maxResults);
+
+    // Largest difference between the batched HOG features of the tileSize tiles of an image, such as the
+    // training sheet, and HOG computed on each tile alone; for tests.  -1 when the image cannot be decoded
+    float SudokuAtlasHOGMismatch(const char * encodedImageData, int length, int tileSize);
+
 #ifdef __cplusplus
 }
 #endif
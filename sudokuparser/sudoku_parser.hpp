@@ -1,14 +1,108 @@
 #ifndef _SUDOKU_PARSER_HPP_
 #define _SUDOKU_PARSER_HPP_
 
+#include <exception>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
+
+#include "digit_classifier.hpp"
+#include "memory_accounting.hpp"
+#include "sudoku_parser.h"
 
 using namespace std;
 
 extern const char *SVM_MODEL_ENV_VAR_NAME;
+extern const char *CASCADE_THRESHOLD_ENV_VAR_NAME;
+extern const char *SCREEN_CLASSIFIER_ENV_VAR_NAME;
+extern const char *SCREEN_THRESHOLD_ENV_VAR_NAME;
+
+// One image of a batch parsed by internalParseSudokuBatch
+struct ParseRequest {
+    const char * encodedImageData;
+    int length;
+    SudokuParseResult * result;     // filled in place; gridPoints on entry are corners to use
+                                    // instead of searching for the grid unless any is -1
+    exception_ptr error;    // set when this image could not be parsed
+};
+
+// Digits found on one board, awaiting classification
+struct BoardDigits {
+    cv::Mat cleaned;
+    vector<cv::Rect> digits;
+    cv::Rect allDigits;
+    vector<float> gridPoints;
+    float scale;
+    int firstTile;
+};
+
+// Classifier backend and cascade settings a parse runs with
+struct ParseContext {
+    shared_ptr<const Sudoku::DigitClassifier> classifier;   // NULL follows the published default
+    float cascadeThreshold;
+};
+
+// The threshold last set with SetDefaultCascadeThreshold, initially GO_SUDOKU_CASCADE_THRESHOLD or 0.85 when unset
+float DefaultCascadeThreshold();
+
+// Set the threshold of parses without their own context; false, changing nothing, outside [0, 1]
+bool SetDefaultCascadeThreshold(float threshold);
+
+/**
+* Screen parses without their own context with backend, passing cells it scores below threshold to the SVM;
+* an empty backend turns screening off.  Initially GO_SUDOKU_SCREEN_CLASSIFIER and GO_SUDOKU_SCREEN_THRESHOLD.
+* Returns false, changing nothing, for a threshold outside [0, 1]; throws invalid_argument for unknown backends
+*/
+bool SetDefaultScreenClassifier(const string &backend, float threshold);
+
+// SVM from GO_SUDOKU_SVM_MODEL, screened by the backend set with SetDefaultScreenClassifier,
+// and DefaultCascadeThreshold()
+ParseContext DefaultParseContext();
+
+// Whether error holds the Sudoku::NoGridError thrown for images failing the quick grid check
+bool IsNoGridError(exception_ptr error);
+
+// The steps of internalParseSudokuBatch, run separately by the staged ParsePipeline.
+// Reset result to an empty puzzle, keeping any grid corners supplied by the caller
+void internalClearResult(SudokuParseResult * result);
 
-const string internalParseSudoku(const char * encodedImageData, int length, float * gridPoints, bool saveOutput);
+// Decode the request's image
+cv::Mat internalDecodeBoard(const ParseRequest &request);
+
+// Locate the grid in image, or warp the request's corners, and find the rects of all digits on it
+void internalDetectBoard(const ParseRequest &request, const cv::Mat &image, BoardDigits &board);
+
+// Classify the digits of every board as one batch and assemble the result of each request without an error
+void internalClassifyBoards(vector<ParseRequest> &requests, vector<BoardDigits> &boards, bool saveOutput,
+                            const ParseContext * context);
+
+// Copy the Mat data recorded by account into result
+void internalRecordMemory(SudokuParseResult * result, const Sudoku::MemoryAccount &account);
+
+// Parse several images, classifying the digits found on all of them as one batch.
+// A NULL context parses with DefaultParseContext()
+void internalParseSudokuBatch(vector<ParseRequest> &requests, bool saveOutput, const ParseContext * context = NULL);
+
+// One of the puzzles found on a page by internalParseSudokuPage
+struct PagePuzzle {
+    SudokuParseResult result;   // corners in page pixels
+    exception_ptr error;
+};
+
+// Find every grid on a page image and parse them together
+vector<PagePuzzle> internalParseSudokuPage(const char * encodedImageData, int length, const ParseContext * context = NULL);
+
+// Parse one image straight into result, throwing when it could not be parsed
+void internalParseSudokuInto(const char * encodedImageData, int length, SudokuParseResult * result, bool saveOutput,
+                             const ParseContext * context = NULL);
+
+const string internalParseSudoku(const char * encodedImageData, int length, float * gridPoints, bool saveOutput,
+                                 float * confidences = NULL, int * stages = NULL, const ParseContext * context = NULL);
 
 string internalTrainSudoku(const char * trainConfigFile);
 
+// Read "image path,81 character label" lines such as train_config.csv
+map<string, string> parseTrainConfig(const char * trainConfigFile);
+
 #endif
\ No newline at end of file
@@ -1,22 +1,339 @@
 #include "sudoku_parser.hpp"
 #include "sudoku_parser.h"
+#include "parse_executor.hpp"
+#include "parse_pipeline.hpp"
+#include "detect_digits.hpp"
+#include "memory_accounting.hpp"
+#include "logging.hpp"
+#include <opencv2/imgcodecs.hpp>
 
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <iostream>
+#include <vector>
+
+using namespace Sudoku;
 
 // Provide implemenation of the external C API
 // this file may wrap the C++ calls but cannot include C++ types such as vector 
 
 const char *SVM_MODEL_VAR = SVM_MODEL_ENV_VAR_NAME;
+const char *CASCADE_THRESHOLD_VAR = CASCADE_THRESHOLD_ENV_VAR_NAME;
+const char *SCREEN_CLASSIFIER_VAR = SCREEN_CLASSIFIER_ENV_VAR_NAME;
+const char *SCREEN_THRESHOLD_VAR = SCREEN_THRESHOLD_ENV_VAR_NAME;
 
-void ParseSudoku(const char * encodedImageData, int length, float * gridPoints, bool saveOutput, char * parsed) {
-    //float* gridPoints = (float*)malloc(8 * sizeof(float));
-    string result = internalParseSudoku(encodedImageData, length, gridPoints, saveOutput);
-    //cout << "Testing string issue: result: " << result << endl << "c_str(): " << result.c_str() << endl;
-    cout << "Returning  parsed result: " << result << endl;
-    strncpy(parsed, result.c_str(), 81);
+void ParseSudoku(const char * encodedImageData, int length, float * gridPoints, bool saveOutput, char * parsed,
+                 float * confidences, int * stages) {
+    SudokuParseResult result;
+    copy(gridPoints, gridPoints + 8, result.gridPoints);
+    internalParseSudokuInto(encodedImageData, length, &result, saveOutput);
+    SUDOKU_LOG_DEBUG("returning parsed result", {{"puzzle", result.puzzle}});
+    memcpy(parsed, result.puzzle, 81);
+    copy(result.gridPoints, result.gridPoints + 8, gridPoints);
+    if (confidences) { copy(result.confidences, result.confidences + 81, confidences); }
+    if (stages) { copy(result.stages, result.stages + 81, stages); }
 }
 
 const char* TrainSudoku(const char * trainConfigFile) {
     return internalTrainSudoku(trainConfigFile).c_str();
-}
\ No newline at end of file
+}
+
+// Queued parses allowed per worker when no capacity is configured
+const int DEFAULT_QUEUE_PER_WORKER = 4;
+
+static mutex executorMutex;
+static shared_ptr<ParseExecutor> executor;
+// replaces the executor for submissions while configured
+static shared_ptr<ParsePipeline> pipeline;
+static int configuredWorkers = 0;
+static int configuredCapacity = 0;
+static ThreadingPolicy configuredPolicy = ThreadingPolicyFromEnv();
+static bool configuredPinning = false;
+
+static atomic<SudokuTicket> nextTicket(1);
+
+// Results of submissions without a callback, held until polled
+struct PolledParse {
+    bool done;
+    SudokuParseResult result;
+};
+static mutex polledMutex;
+static map<SudokuTicket, PolledParse> polled;
+
+static shared_ptr<ParseExecutor> sharedExecutor() {
+    lock_guard<mutex> lock(executorMutex);
+    if (!executor) {
+        size_t policyWorkers = ApplyThreadingPolicy(configuredPolicy);
+        size_t workers = configuredWorkers > 0 ? configuredWorkers : policyWorkers;
+        size_t capacity = configuredCapacity > 0 ? configuredCapacity : workers * DEFAULT_QUEUE_PER_WORKER;
+        executor = make_shared<ParseExecutor>(workers, capacity, configuredPinning);
+        SUDOKU_LOG_INFO("started parse executor", {{"workers", workers}, {"capacity", capacity},
+                                                   {"policy", static_cast<int>(configuredPolicy)}, {"pinned", configuredPinning ? "yes" : "no"}});
+    }
+    return executor;
+}
+
+struct SudokuContext {
+    shared_ptr<const ParseContext> parse;
+};
+
+SudokuContext * CreateSudokuContext(const char * backend, const char * modelPath, float cascadeThreshold) {
+    try {
+        string backendName = backend ? backend : "svm";
+        string modelFile = modelPath ? modelPath : "";
+        ParseContext parse;
+        parse.cascadeThreshold = cascadeThreshold >= 0 ? cascadeThreshold : DefaultCascadeThreshold();
+        if (backendName == "svm" && modelFile.empty()) {
+            // follow the published default through reloads, checking now that it loads
+            string name = DefaultDigitClassifier()->name();
+            SUDOKU_LOG_INFO("created parse context", {{"classifier", name}, {"threshold", parse.cascadeThreshold}});
+        } else {
+            parse.classifier = CreateDigitClassifier(backendName, modelFile);
+            SUDOKU_LOG_INFO("created parse context", {{"classifier", parse.classifier->name()}, {"threshold", parse.cascadeThreshold}});
+        }
+
+        SudokuContext * context = new SudokuContext();
+        context->parse = make_shared<const ParseContext>(parse);
+        return context;
+    } catch (const std::exception& e) {
+        SUDOKU_LOG_ERROR("could not create parse context", {{"error", e.what()}});
+    }
+    return NULL;
+}
+
+void FreeSudokuContext(SudokuContext * context) {
+    delete context;
+}
+
+bool SetParseCascadeThreshold(float threshold) {
+    return SetDefaultCascadeThreshold(threshold);
+}
+
+bool SetParseScreenClassifier(const char * backend, float threshold) {
+    try {
+        return SetDefaultScreenClassifier(backend ? backend : "", threshold);
+    } catch (const std::exception& e) {
+        SUDOKU_LOG_ERROR("could not load screen classifier", {{"backend", backend}, {"error", e.what()}});
+    }
+    return false;
+}
+
+long long ReloadSudokuModel(const char * modelPath) {
+    try {
+        return static_cast<long long>(ReloadDigitClassifier(modelPath ? modelPath : ""));
+    } catch (const std::exception& e) {
+        SUDOKU_LOG_ERROR("could not reload model", {{"error", e.what()}});
+    }
+    return -1;
+}
+
+long long SudokuModelGeneration(void) {
+    return static_cast<long long>(DigitClassifierGeneration());
+}
+
+static void parseInto(const ParseContext * context, const char * encodedImageData, int length, const float * corners,
+                      SudokuParseResult * result) {
+    result->status = SUDOKU_PARSE_ERROR;
+    if (corners) {
+        copy(corners, corners + 8, result->gridPoints);
+    } else {
+        fill(result->gridPoints, result->gridPoints + 8, -1.0f);
+    }
+    try {
+        internalParseSudokuInto(encodedImageData, length, result, false, context);
+    } catch (const NoGridError& e) {
+        SUDOKU_LOG_DEBUG("no grid in image", {{"bytes", length}});
+        result->status = SUDOKU_PARSE_NO_GRID;
+    } catch (const std::exception& e) {
+        SUDOKU_LOG_ERROR("exception occurred while parsing", {{"error", e.what()}});
+    } catch (...) {
+        SUDOKU_LOG_ERROR("exception occurred while parsing");
+    }
+}
+
+bool ConfigureParseExecutor(int workers, int queueCapacity) {
+    lock_guard<mutex> lock(executorMutex);
+    if (executor) {
+        return false;
+    }
+    configuredWorkers = workers;
+    configuredCapacity = queueCapacity;
+    return true;
+}
+
+static shared_ptr<ParsePipeline> sharedPipeline() {
+    lock_guard<mutex> lock(executorMutex);
+    return pipeline;
+}
+
+int ParseExecutorCapacity(void) {
+    shared_ptr<ParsePipeline> stages = sharedPipeline();
+    if (stages) {
+        return static_cast<int>(stages->capacity());
+    }
+    shared_ptr<ParseExecutor> pool = sharedExecutor();
+    return static_cast<int>(pool->workerCount() + pool->queueCapacity());
+}
+
+void ConfigureParseThreading(int policy, bool pinWorkers) {
+    shared_ptr<ParseExecutor> previous;
+    {
+        lock_guard<mutex> lock(executorMutex);
+        configuredPolicy = static_cast<ThreadingPolicy>(policy);
+        configuredPinning = pinWorkers;
+        previous.swap(executor);
+    }
+    // the next submission starts an executor under the new policy once this one has drained
+    previous.reset();
+}
+
+void ConfigureParsePipeline(const SudokuPipelineConfig * config) {
+    shared_ptr<ParsePipeline> started;
+    if (config) {
+        PipelineConfig stages = DefaultPipelineConfig();
+        if (config->decodeThreads > 0) { stages.decodeThreads = config->decodeThreads; }
+        if (config->detectThreads > 0) { stages.detectThreads = config->detectThreads; }
+        if (config->classifyThreads > 0) { stages.classifyThreads = config->classifyThreads; }
+        if (config->queueCapacity > 0) { stages.queueCapacity = config->queueCapacity; }
+        if (config->maxBatch > 0) { stages.maxBatch = config->maxBatch; }
+        started = make_shared<ParsePipeline>(stages);
+        SUDOKU_LOG_INFO("started parse pipeline", {{"decode", stages.decodeThreads}, {"detect", stages.detectThreads},
+                                                   {"classify", stages.classifyThreads}, {"capacity", started->capacity()},
+                                                   {"batch", stages.maxBatch}});
+    }
+
+    shared_ptr<ParsePipeline> previous;
+    {
+        lock_guard<mutex> lock(executorMutex);
+        previous.swap(pipeline);
+        pipeline = started;
+    }
+    // completes every parse already queued on the old pipeline
+    previous.reset();
+}
+
+void ParsePipelineDepths(SudokuPipelineDepths * depths) {
+    shared_ptr<ParsePipeline> stages = sharedPipeline();
+    PipelineDepths queued = stages ? stages->depths() : PipelineDepths{0, 0, 0};
+    depths->decode = static_cast<int>(queued.decode);
+    depths->detect = static_cast<int>(queued.detect);
+    depths->classify = static_cast<int>(queued.classify);
+}
+
+SudokuTicket SubmitParseSudoku(const SudokuContext * context, const char * encodedImageData, int length,
+                               const float * corners, bool block, SudokuParseCallback callback, void * userData) {
+    SudokuTicket ticket = nextTicket++;
+    auto data = make_shared<vector<char> >(encodedImageData, encodedImageData + length);
+    auto gridCorners = corners ? make_shared<vector<float> >(corners, corners + 8) : shared_ptr<vector<float> >();
+    // queued parses keep the settings alive should the context be freed before they run
+    shared_ptr<const ParseContext> parse = context ? context->parse : shared_ptr<const ParseContext>();
+
+    if (!callback) {
+        lock_guard<mutex> lock(polledMutex);
+        polled[ticket].done = false;
+    }
+
+    // hand a finished result to the callback or hold it until polled
+    auto deliver = [ticket, callback, userData](SudokuParseResult &result) {
+        if (callback) {
+            callback(ticket, &result, userData);
+        } else {
+            PolledParse entry;
+            entry.result = result;
+            entry.done = true;
+            lock_guard<mutex> lock(polledMutex);
+            polled[ticket] = entry;
+        }
+    };
+
+    bool queued;
+    shared_ptr<ParsePipeline> stages = sharedPipeline();
+    if (stages) {
+        queued = stages->submit(data, corners, parse, [deliver, length](SudokuParseResult &result, exception_ptr error) {
+            if (error && !IsNoGridError(error)) {
+                try {
+                    rethrow_exception(error);
+                } catch (const std::exception& e) {
+                    SUDOKU_LOG_ERROR("exception occurred while parsing", {{"error", e.what()}});
+                } catch (...) {
+                    SUDOKU_LOG_ERROR("exception occurred while parsing");
+                }
+            } else if (error) {
+                SUDOKU_LOG_DEBUG("no grid in image", {{"bytes", length}});
+            }
+            deliver(result);
+        }, block);
+    } else {
+        queued = sharedExecutor()->submit([data, gridCorners, parse, deliver]() {
+            SudokuParseResult result;
+            parseInto(parse.get(), data->data(), static_cast<int>(data->size()),
+                      gridCorners ? gridCorners->data() : NULL, &result);
+            deliver(result);
+        }, block);
+    }
+
+    if (!queued) {
+        if (!callback) {
+            lock_guard<mutex> lock(polledMutex);
+            polled.erase(ticket);
+        }
+        return SUDOKU_QUEUE_FULL;
+    }
+    return ticket;
+}
+
+void EnableParseMemoryAccounting(void) {
+    InstallMemoryAccounting();
+}
+
+void ParseMemoryTotals(SudokuMemoryTotals * totals) {
+    MemoryTotals current = CurrentMemoryTotals();
+    totals->liveBytes = static_cast<long long>(current.liveBytes);
+    totals->peakLiveBytes = static_cast<long long>(current.peakLiveBytes);
+    totals->peakParseBytes = static_cast<long long>(current.peakParseBytes);
+}
+
+int PollParseSudoku(SudokuTicket ticket, SudokuParseResult * result) {
+    lock_guard<mutex> lock(polledMutex);
+    auto search = polled.find(ticket);
+    if (search == polled.end()) {
+        return -1;
+    }
+    if (!search->second.done) {
+        return 0;
+    }
+    *result = search->second.result;
+    polled.erase(search);
+    return 1;
+}
+
+int ParseSudokuPage(const SudokuContext * context, const char * encodedImageData, int length,
+                    SudokuParseResult * results, int maxResults) {
+    vector<PagePuzzle> puzzles;
+    try {
+        puzzles = internalParseSudokuPage(encodedImageData, length, context ? context->parse.get() : NULL);
+    } catch (const std::exception& e) {
+        SUDOKU_LOG_ERROR("exception occurred while parsing page", {{"error", e.what()}});
+        return 0;
+    }
+
+    for (int i = 0; i < static_cast<int>(puzzles.size()) && i < maxResults; i++) {
+        results[i] = puzzles[i].result;
+        if (puzzles[i].error) {
+            results[i].status = SUDOKU_PARSE_ERROR;
+        }
+    }
+    return static_cast<int>(puzzles.size());
+}
+
+float SudokuAtlasHOGMismatch(const char * encodedImageData, int length, int tileSize) {
+    cv::Mat sheet = cv::imdecode(cv::Mat(1, length, CV_8UC1, const_cast<char *>(encodedImageData)), cv::IMREAD_GRAYSCALE);
+    if (sheet.empty() || tileSize <= 0) {
+        return -1;
+    }
+    return AtlasHOGMismatch(sheet, tileSize);
+}
@@ -11,20 +11,24 @@ package sudokuparser
 #cgo darwin CXXFLAGS: --std=c++1z -stdlib=libc++
 #cgo darwin LDFLAGS: -L/usr/local/Cellar/opencv3/3.2.0/lib -lopencv_core -lopencv_highgui -lopencv_imgcodecs -lopencv_imgproc -lopencv_ml -lopencv_objdetect -lopencv_photo
 #cgo linux CPPFLAGS: -I/usr/include -I/usr/include/opencv2 -I/usr/local/include -I/usr/local/include/opencv2
-#cgo linux CXXFLAGS: --std=c++1z
-#cgo linux LDFLAGS: -L/usr/lib -lopencv_core -lopencv_highgui -lopencv_imgcodecs -lopencv_imgproc -lopencv_ml -lopencv_objdetect -lopencv_photo
+#cgo linux CXXFLAGS: --std=c++1z -pthread
+#cgo linux LDFLAGS: -pthread -L/usr/lib -lopencv_core -lopencv_highgui -lopencv_imgcodecs -lopencv_imgproc -lopencv_ml -lopencv_objdetect -lopencv_photo
 #include <stdlib.h>
 #include "sudoku_parser.h"
+
+extern void goParseComplete(SudokuTicket ticket, SudokuParseResult * result, void * userData);
 */
 import "C"
 
 import (
+	"errors"
 	"fmt"
 	"io/ioutil"
 	"log"
 	"os"
 	"path"
-	"strings"
+	"sync"
+	"time"
 	"unsafe"
 )
 
@@ -34,7 +38,188 @@ type Point2d struct {
 	Y int `json:"y"`
 }
 
+// CellDetail describes how a single puzzle cell was classified
+type CellDetail struct {
+	Value      int     `json:"value"` // 0 for an empty cell
+	Confidence float32 `json:"confidence"`
+	Stage      int     `json:"stage"`
+	Box        CellBox `json:"box"`
+}
+
+// CellBox is the bounding box of a digit in the flattened grid image
+type CellBox struct {
+	X      int `json:"x"`
+	Y      int `json:"y"`
+	Width  int `json:"width"`
+	Height int `json:"height"`
+}
+
+// ParseTimings breaks a parse down by step.  Classification is shared by every
+// grid parsed together, so it is repeated across the puzzles of a page
+type ParseTimings struct {
+	Decode   time.Duration
+	Detect   time.Duration
+	Classify time.Duration
+	Total    time.Duration
+}
+
+// Cascade stages reported in CellDetail.Stage
+const (
+	StageEmpty = iota
+	StageFast
+	StageDenoised
+	StageDeskewed
+)
+
+// DefaultCascadeThreshold is the confidence at which cells skip despeckling and deskewing
+// unless overridden with SetCascadeThreshold
+const DefaultCascadeThreshold = 0.85
+
+// ErrNoGrid is the ParseResult error for images rejected by the quick check for a grid,
+// such as photos without a puzzle, which is made before any full parse
+var ErrNoGrid = errors.New("no sudoku grid in image")
+
+// ErrQueueFull is the ParseResult error when a parse could not be queued
+var ErrQueueFull = errors.New("sudoku parse queue is full")
+
+// MemoryUsage counts the OpenCV image data allocated while decoding an image, finding
+// its grid and cleaning it.  Page results report the whole page
+type MemoryUsage struct {
+	AllocatedBytes int64 // including buffers freed before the parse finished
+	PeakBytes      int64 // most held at once
+}
+
+// ParseResult is the outcome of a parse queued with ParseSudokuAsync
+type ParseResult struct {
+	Puzzle  string
+	Points  []Point2d
+	Cells   []CellDetail
+	Timings ParseTimings
+	Memory  MemoryUsage
+	Err     error
+}
+
+// MemoryTotals is the OpenCV image data held across the process, counted from the first parse
+type MemoryTotals struct {
+	LiveBytes      int64
+	PeakLiveBytes  int64
+	PeakParseBytes int64 // largest MemoryUsage.PeakBytes of any parse so far
+}
+
+// CurrentMemoryTotals reports image data held now and at its peak, for metrics
+func CurrentMemoryTotals() MemoryTotals {
+	var totals C.SudokuMemoryTotals
+	C.ParseMemoryTotals(&totals)
+	return MemoryTotals{
+		LiveBytes:      int64(totals.liveBytes),
+		PeakLiveBytes:  int64(totals.peakLiveBytes),
+		PeakParseBytes: int64(totals.peakParseBytes),
+	}
+}
+
+// page parses run on the caller's goroutine, so account their memory before any can start
+func init() {
+	C.EnableParseMemoryAccounting()
+}
+
 var svmModelPath string
+var svmModelOnce sync.Once
+
+// pendingParse is a submitted parse awaiting its callback
+type pendingParse struct {
+	done  chan ParseResult
+	slots chan struct{}
+}
+
+var (
+	pendingMutex sync.Mutex
+	pending      = map[C.SudokuTicket]pendingParse{}
+	// results delivered before submitParse registered their ticket
+	finished = map[C.SudokuTicket]ParseResult{}
+
+	// parseSlots bounds outstanding parses to the executor capacity so excess
+	// callers wait as parked goroutines rather than as OS threads blocked in cgo.
+	// It is recreated whenever the executor is reconfigured
+	parseSlots      chan struct{}
+	parseSlotsMutex sync.Mutex
+)
+
+// ThreadingPolicy decides how cores are shared between concurrent parses and
+// OpenCV's own parallel loops
+type ThreadingPolicy int
+
+// Threading policies accepted by ConfigureThreading
+const (
+	// ThreadingDefault runs one parse worker per core and leaves OpenCV's threading alone
+	ThreadingDefault ThreadingPolicy = C.SUDOKU_THREADING_DEFAULT
+	// ThreadingIntraImage runs one parse at a time with OpenCV using every core
+	ThreadingIntraImage ThreadingPolicy = C.SUDOKU_THREADING_INTRA_IMAGE
+	// ThreadingInterImage runs one single-threaded parse per core
+	ThreadingInterImage ThreadingPolicy = C.SUDOKU_THREADING_INTER_IMAGE
+)
+
+// ConfigureThreading sets the threading policy for all parses in the process, optionally
+// pinning each parse worker to a core.  Call it while no parses are outstanding
+func ConfigureThreading(policy ThreadingPolicy, pinWorkers bool) {
+	parseSlotsMutex.Lock()
+	defer parseSlotsMutex.Unlock()
+	C.ConfigureParseThreading(C.int(policy), C.bool(pinWorkers))
+	parseSlots = nil
+}
+
+// PipelineConfig sizes the stages of the pipelined engine; zero fields take the defaults
+type PipelineConfig struct {
+	DecodeThreads   int
+	DetectThreads   int // grid detection, cleaning and line removal
+	ClassifyThreads int
+	QueueCapacity   int // images queued in front of each stage
+	MaxBatch        int // boards whose digits are classified together
+}
+
+// PipelineDepths counts the images waiting in front of each pipeline stage
+type PipelineDepths struct {
+	Decode   int
+	Detect   int
+	Classify int
+}
+
+// ConfigurePipeline runs parses through separate decode, detection and classification
+// stages so consecutive images overlap, or through the executor again when config is nil.
+// Call it while no parses are outstanding
+func ConfigurePipeline(config *PipelineConfig) {
+	parseSlotsMutex.Lock()
+	defer parseSlotsMutex.Unlock()
+	if config == nil {
+		C.ConfigureParsePipeline(nil)
+	} else {
+		stages := C.SudokuPipelineConfig{
+			decodeThreads:   C.int(config.DecodeThreads),
+			detectThreads:   C.int(config.DetectThreads),
+			classifyThreads: C.int(config.ClassifyThreads),
+			queueCapacity:   C.int(config.QueueCapacity),
+			maxBatch:        C.int(config.MaxBatch),
+		}
+		C.ConfigureParsePipeline(&stages)
+	}
+	parseSlots = nil
+}
+
+// CurrentPipelineDepths reports how many images wait in front of each stage,
+// all zero when no pipeline is configured
+func CurrentPipelineDepths() PipelineDepths {
+	var depths C.SudokuPipelineDepths
+	C.ParsePipelineDepths(&depths)
+	return PipelineDepths{Decode: int(depths.decode), Detect: int(depths.detect), Classify: int(depths.classify)}
+}
+
+func currentParseSlots() chan struct{} {
+	parseSlotsMutex.Lock()
+	defer parseSlotsMutex.Unlock()
+	if parseSlots == nil {
+		parseSlots = make(chan struct{}, int(C.ParseExecutorCapacity()))
+	}
+	return parseSlots
+}
 
 // ParseSudokuFromFile parses a Sudoku puzzle using a file path to a Sudoku image
 func ParseSudokuFromFile(filename string) (string, []Point2d) {
@@ -53,42 +238,271 @@ func ParseSudokuFromFile(filename string) (string, []Point2d) {
 	return ParseSudokuFromByteArray(data)
 }
 
-// ParseSudokuFromByteArray parses a Sudoku puzzle from an image byte array
+// ParseSudokuFromByteArray parses a Sudoku puzzle from an image byte array.
+// Images which cannot be parsed give an empty puzzle
 func ParseSudokuFromByteArray(data []byte) (string, []Point2d) {
-	if svmModelPath == "" {
-		svmModelPath = setupSVMModel()
-		svmEnvVar := C.GoString(C.SVM_MODEL_VAR)
-		err := os.Setenv(svmEnvVar, svmModelPath)
-		if err != nil {
-			panic(err)
+	parsed, coords, _, err := ParseSudokuDetailsFromByteArray(data)
+	if err != nil && err != ErrNoGrid {
+		log.Printf("sudoku parse failed: %v", err)
+	}
+	return parsed, coords
+}
+
+// ParseSudokuDetailsFromByteArray parses a Sudoku puzzle from an image byte array and
+// also returns the classification confidence and cascade stage of all 81 cells.
+// Images without a grid give an empty puzzle along with ErrNoGrid
+func ParseSudokuDetailsFromByteArray(data []byte) (string, []Point2d, []CellDetail, error) {
+	result := <-ParseSudokuAsync(data)
+	if result.Err != nil {
+		return "", []Point2d{}, nil, result.Err
+	}
+
+	return result.Puzzle, result.Points, result.Cells, nil
+}
+
+// Digit classifier backends accepted by NewContext
+const (
+	BackendSVM      = "svm"
+	BackendCNN      = "cnn"
+	BackendLinear   = "linear"
+	BackendCentroid = "centroid"
+)
+
+// Context parses with its own digit classifier backend and cascade threshold.
+// It is safe for concurrent use and may be closed while parses are still queued
+type Context struct {
+	ptr *C.SudokuContext
+}
+
+// NewContext loads a classifier backend.  An empty modelPath uses the backend's default
+// model and a negative threshold the one set with SetCascadeThreshold.  The "cnn" backend
+// runs an ONNX model named by modelPath or GO_SUDOKU_CNN_MODEL, none of which ships with
+// the package, and needs it built with the dnn tag against OpenCV 3.4.3 or newer
+func NewContext(backend, modelPath string, threshold float64) (*Context, error) {
+	setupSVMEnvironment()
+
+	cBackend := C.CString(backend)
+	defer C.free(unsafe.Pointer(cBackend))
+	cModelPath := C.CString(modelPath)
+	defer C.free(unsafe.Pointer(cModelPath))
+
+	ptr := C.CreateSudokuContext(cBackend, cModelPath, C.float(threshold))
+	if ptr == nil {
+		return nil, fmt.Errorf("could not load %s digit classifier", backend)
+	}
+	return &Context{ptr: ptr}, nil
+}
+
+// Close releases the classifier once parses already queued with it complete
+func (c *Context) Close() {
+	if c.ptr != nil {
+		C.FreeSudokuContext(c.ptr)
+		c.ptr = nil
+	}
+}
+
+// ParseSudokuAsync queues a parse with this context's classifier on the shared C++ executor
+func (c *Context) ParseSudokuAsync(data []byte) <-chan ParseResult {
+	return submitParse(c.ptr, data, nil)
+}
+
+// ParseSudokuWithCornersAsync queues a parse with this context's classifier which warps
+// the grid at corners instead of searching the image for it
+func (c *Context) ParseSudokuWithCornersAsync(data []byte, corners []Point2d) <-chan ParseResult {
+	return submitParse(c.ptr, data, corners)
+}
+
+// ParseSudokuAsync queues a parse on the shared C++ executor and returns a channel
+// which receives the result once a worker has processed the image
+func ParseSudokuAsync(data []byte) <-chan ParseResult {
+	setupSVMEnvironment()
+	return submitParse(nil, data, nil)
+}
+
+// ParseSudokuWithCornersAsync queues a parse which warps the grid at corners, typically the
+// Points of an earlier parse adjusted by the user, skipping grid detection.  corners are
+// clockwise from the top left; any other number of points falls back to detection
+func ParseSudokuWithCornersAsync(data []byte, corners []Point2d) <-chan ParseResult {
+	setupSVMEnvironment()
+	return submitParse(nil, data, corners)
+}
+
+func submitParse(context *C.SudokuContext, data []byte, corners []Point2d) <-chan ParseResult {
+	slots := currentParseSlots()
+	done := make(chan ParseResult, 1)
+	slots <- struct{}{}
+
+	p := C.CBytes(data)
+	defer C.free(unsafe.Pointer(p))
+
+	var gridCorners *C.float
+	if len(corners) == 4 {
+		points := make([]C.float, 8)
+		for i, corner := range corners {
+			points[i*2] = C.float(corner.X)
+			points[(i*2)+1] = C.float(corner.Y)
 		}
+		// copied by SubmitParseSudoku before it returns
+		gridCorners = &points[0]
+	}
 
-		fmt.Print(fmt.Sprintf("Set environment variable %s=%s\n", svmEnvVar, svmModelPath))
+	// the slots already bound outstanding parses, so wait for the moment a worker takes to free
+	// its queue entry rather than failing.  The lock is not held here as the callback takes it
+	ticket := C.SubmitParseSudoku(context, (*C.char)(p), C.int(len(data)), gridCorners, C.bool(true),
+		C.SudokuParseCallback(C.goParseComplete), nil)
+	if ticket == C.SUDOKU_QUEUE_FULL {
+		<-slots
+		done <- ParseResult{Err: ErrQueueFull}
+		return done
+	}
+
+	pendingMutex.Lock()
+	defer pendingMutex.Unlock()
+	if parsed, ok := finished[ticket]; ok {
+		// completed before it could be registered
+		delete(finished, ticket)
+		<-slots
+		done <- parsed
+		return done
+	}
+	pending[ticket] = pendingParse{done: done, slots: slots}
+
+	return done
+}
+
+//export goParseComplete
+func goParseComplete(ticket C.SudokuTicket, result *C.SudokuParseResult, userData unsafe.Pointer) {
+	parsed := convertResult(result)
+
+	pendingMutex.Lock()
+	submitted, ok := pending[ticket]
+	if !ok {
+		// submitParse has not registered the ticket yet and collects the result itself
+		finished[ticket] = parsed
+		pendingMutex.Unlock()
+		return
 	}
+	delete(pending, ticket)
+	pendingMutex.Unlock()
+
+	<-submitted.slots
+	submitted.done <- parsed
+}
+
+// MaxPagePuzzles is the most puzzles ParseSudokuPage reports from one page
+const MaxPagePuzzles = 16
 
-	parsed := C.CString(strings.Repeat("0", 81))
-	defer C.free(unsafe.Pointer(parsed))
+// ParseSudokuPage finds every puzzle grid on a page image, such as a newspaper or
+// puzzle book scan, parses them in parallel and returns them top to bottom, then
+// left to right.  Points are the corners of each grid in page pixels
+func ParseSudokuPage(data []byte) []ParseResult {
+	setupSVMEnvironment()
+	return parsePage(nil, data)
+}
+
+// ParseSudokuPage finds and parses every puzzle grid on a page with this context's classifier
+func (c *Context) ParseSudokuPage(data []byte) []ParseResult {
+	return parsePage(c.ptr, data)
+}
 
+func parsePage(context *C.SudokuContext, data []byte) []ParseResult {
 	p := C.CBytes(data)
 	defer C.free(unsafe.Pointer(p))
 
-	// float32 is standard type compatible with C
-	gridCoords := []float32{-1, -1, -1, -1, -1, -1, -1, -1}
+	results := make([]C.SudokuParseResult, MaxPagePuzzles)
+	found := int(C.ParseSudokuPage(context, (*C.char)(p), C.int(len(data)), &results[0], C.int(len(results))))
+	if found > len(results) {
+		found = len(results)
+	}
 
-	C.ParseSudoku((*C.char)(p), C.int(len(data)), (*C.float)(unsafe.Pointer(&gridCoords[0])), true, parsed)
+	parsed := make([]ParseResult, found)
+	for i := range parsed {
+		parsed[i] = convertResult(&results[i])
+	}
+	return parsed
+}
+
+func convertResult(result *C.SudokuParseResult) ParseResult {
+	parsed := ParseResult{}
+	parsed.Memory = MemoryUsage{
+		AllocatedBytes: int64(result.memory.allocatedBytes),
+		PeakBytes:      int64(result.memory.peakBytes),
+	}
+	if result.status == C.SUDOKU_PARSE_NO_GRID {
+		parsed.Err = ErrNoGrid
+	} else if result.status != C.SUDOKU_PARSE_OK {
+		parsed.Err = errors.New("sudoku parse failed")
+	} else {
+		parsed.Puzzle = C.GoString(&result.puzzle[0])
+		parsed.Points = []Point2d{}
+		for i := 0; i < 4; i++ {
+			x := float32(result.gridPoints[i*2])
+			y := float32(result.gridPoints[(i*2)+1])
+			if x > -1 && y > -1 {
+				parsed.Points = append(parsed.Points, Point2d{X: int(x), Y: int(y)})
+			}
+		}
+		parsed.Cells = make([]CellDetail, 81)
+		for i := range parsed.Cells {
+			box := result.boxes[i]
+			parsed.Cells[i] = CellDetail{
+				Value:      int(result.values[i]),
+				Confidence: float32(result.confidences[i]),
+				Stage:      int(result.stages[i]),
+				Box:        CellBox{X: int(box.x), Y: int(box.y), Width: int(box.width), Height: int(box.height)},
+			}
+		}
+		parsed.Timings = ParseTimings{
+			Decode:   millis(result.timings.decodeMs),
+			Detect:   millis(result.timings.detectMs),
+			Classify: millis(result.timings.classifyMs),
+			Total:    millis(result.timings.totalMs),
+		}
+	}
+	return parsed
+}
+
+func millis(ms C.float) time.Duration {
+	return time.Duration(float64(ms) * float64(time.Millisecond))
+}
 
-	coords := []Point2d{}
-	for i := 0; i < 4; i++ {
-		x := i * 2
-		y := (i * 2) + 1
-		if gridCoords[x] > -1 && gridCoords[y] > -1 {
-			fmt.Print(fmt.Sprintf("Grid coord (%f, %f)\n", gridCoords[i*2], gridCoords[(i*2)+1]))
-			coords = append(coords, Point2d{X: int(gridCoords[x]), Y: int(gridCoords[y])})
+func setupSVMEnvironment() {
+	svmModelOnce.Do(func() {
+		svmModelPath = setupSVMModel()
+		svmEnvVar := C.GoString(C.SVM_MODEL_VAR)
+		err := os.Setenv(svmEnvVar, svmModelPath)
+		if err != nil {
+			panic(err)
 		}
+
+		fmt.Print(fmt.Sprintf("Set environment variable %s=%s\n", svmEnvVar, svmModelPath))
+	})
+}
+
+// SetCascadeThreshold sets the minimum confidence, between 0 and 1, at which a cell's first,
+// cheapest classification is accepted; use 1 to despeckle every cell short of full confidence
+func SetCascadeThreshold(threshold float64) error {
+	if !C.SetParseCascadeThreshold(C.float(threshold)) {
+		return fmt.Errorf("cascade threshold %f outside [0, 1]", threshold)
 	}
-	goString := C.GoString(parsed)
+	return nil
+}
 
-	return goString, coords
+// SetScreenClassifier has parses without their own Context classify every cell with a cheap
+// backend first, such as "linear-int8", and pass only cells scored below threshold to the SVM.
+// An empty backend turns screening off.  The linear and centroid models are written by TrainSudoku
+func SetScreenClassifier(backend string, threshold float64) error {
+	if !(threshold >= 0 && threshold <= 1) {
+		return fmt.Errorf("screen threshold %f outside [0, 1]", threshold)
+	}
+	// linear and centroid screens load their models from beside the SVM's
+	setupSVMEnvironment()
+	cBackend := C.CString(backend)
+	defer C.free(unsafe.Pointer(cBackend))
+	if !C.SetParseScreenClassifier(cBackend, C.float(threshold)) {
+		return fmt.Errorf("could not load %s screen classifier", backend)
+	}
+	return nil
 }
 
 func setupSVMModel() string {
@@ -117,6 +531,35 @@ func setupSVMModel() string {
 	return tmpModelFile
 }
 
+// ReloadModel loads the SVM at modelPath, or the default model when empty, and publishes
+// it to every parse using the default SVM without pausing parses in flight, which finish
+// with the model they started with.  It returns the new model generation
+func ReloadModel(modelPath string) (int64, error) {
+	var path *C.char
+	if modelPath != "" {
+		path = C.CString(modelPath)
+		defer C.free(unsafe.Pointer(path))
+	}
+	generation := int64(C.ReloadSudokuModel(path))
+	if generation < 0 {
+		return 0, fmt.Errorf("could not load sudoku model %q", modelPath)
+	}
+	return generation, nil
+}
+
+// ModelGeneration counts the default models published by ReloadModel, TrainSudoku and first use
+func ModelGeneration() int64 {
+	return int64(C.SudokuModelGeneration())
+}
+
+// atlasHOGMismatch is the largest difference between HOG features computed over an atlas of the
+// tileSize tiles of an image and over each tile alone, or -1 when the image cannot be decoded
+func atlasHOGMismatch(data []byte, tileSize int) float64 {
+	p := C.CBytes(data)
+	defer C.free(p)
+	return float64(C.SudokuAtlasHOGMismatch((*C.char)(p), C.int(len(data)), C.int(tileSize)))
+}
+
 // Parse a Sudoku puzzle from an image byte array
 func TrainSudoku(trainConfigFile string) string {
 
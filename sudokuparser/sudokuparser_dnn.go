@@ -0,0 +1,10 @@
+//go:build dnn
+// +build dnn
+
+package sudokuparser
+
+// Builds the "cnn" digit classifier backend, which needs OpenCV 3.4.3 or newer with the dnn module
+
+// #cgo CPPFLAGS: -DSUDOKU_WITH_DNN
+// #cgo LDFLAGS: -lopencv_dnn
+import "C"
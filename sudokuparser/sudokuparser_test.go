@@ -1,13 +1,57 @@
 package sudokuparser
 
 import (
+	"bufio"
+	"bytes"
+	"fmt"
+	"image"
+	"image/color"
+	_ "image/jpeg"
+	"image/png"
+	"io/ioutil"
+	"math"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"strings"
 	"testing"
+	"time"
 )
 
-func TestParseSudokuFromFile(t *testing.T) {
-	const sample800wi = "7....3..2..4...1.9..52.9....2..15.7...........9.47..8....7.48..3.2...5..9..3....1"
-	const sample800wiFile = "../samples/800wi.png"
+const sample800wi = "7....3..2..4...1.9..52.9....2..15.7...........9.47..8....7.48..3.2...5..9..3....1"
+const sample800wiFile = "../samples/800wi.png"
+
+// labeledSample is an image from the benchmark corpus along with its expected puzzle
+type labeledSample struct {
+	file   string
+	puzzle string
+	data   []byte
+}
+
+// loadCorpus reads every image listed in train_config.csv along with its label
+func loadCorpus(tb testing.TB) []labeledSample {
+	file, err := os.Open("train_config.csv")
+	if err != nil {
+		tb.Fatal(err)
+	}
+	defer file.Close()
+
+	samples := []labeledSample{}
+	scanner := bufio.NewScanner(file)
+	for scanner.Scan() {
+		tokens := strings.Split(scanner.Text(), ",")
+		if len(tokens) == 2 {
+			data, err := ioutil.ReadFile(tokens[0])
+			if err != nil {
+				tb.Fatal(err)
+			}
+			samples = append(samples, labeledSample{file: tokens[0], puzzle: tokens[1], data: data})
+		}
+	}
+	return samples
+}
 
+func TestParseSudokuFromFile(t *testing.T) {
 	if sudokuString, _ := ParseSudokuFromFile(sample800wiFile); sudokuString != sample800wi {
 		t.Error(sample800wiFile + " not parsed as " + sample800wi + ": \n" + sudokuString)
 	}
@@ -22,6 +66,415 @@ func TestParseNewsprintSudokuFromFile(t *testing.T) {
 	}
 }
 
+func TestParseSudokuCellDetails(t *testing.T) {
+	data, err := ioutil.ReadFile(sample800wiFile)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	_, _, details, err := ParseSudokuDetailsFromByteArray(data)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for i, detail := range details {
+		if sample800wi[i] == '.' && detail.Stage != StageEmpty {
+			t.Errorf("cell %d should be empty but has stage %d", i, detail.Stage)
+		} else if sample800wi[i] != '.' && (detail.Stage == StageEmpty || detail.Confidence <= 0 || detail.Confidence > 1) {
+			t.Errorf("cell %d has unexpected stage %d / confidence %f", i, detail.Stage, detail.Confidence)
+		}
+	}
+}
+
+func TestAtlasHOGFeatures(t *testing.T) {
+	// the training sheet holds the same 28 pixel tiles the SVM was trained on one at a time
+	data, err := ioutil.ReadFile("combined.png")
+	if err != nil {
+		t.Fatal(err)
+	}
+	if mismatch := atlasHOGMismatch(data, 28); mismatch < 0 || mismatch > 1e-5 {
+		t.Errorf("atlas HOG features differ from per-tile features by %g", mismatch)
+	}
+}
+
+func TestParseSudokuAsync(t *testing.T) {
+	data, err := ioutil.ReadFile(sample800wiFile)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	// submit more parses than the executor runs at once
+	results := []<-chan ParseResult{}
+	for i := 0; i < 16; i++ {
+		results = append(results, ParseSudokuAsync(data))
+	}
+	for _, done := range results {
+		if result := <-done; result.Err != nil || result.Puzzle != sample800wi {
+			t.Errorf("async parse returned %q, %v", result.Puzzle, result.Err)
+		}
+	}
+}
+
+// memoryBudget allows a parse six full-colour copies of the decoded image plus 8 MiB
+// for the flattened grid and digit tiles
+func memoryBudget(config image.Config) int64 {
+	return int64(6*3*config.Width*config.Height) + 8*1024*1024
+}
+
+func TestParseMemoryBudget(t *testing.T) {
+	files, err := filepath.Glob("../samples/*")
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	for _, file := range files {
+		data, err := ioutil.ReadFile(file)
+		if err != nil {
+			t.Fatal(err)
+		}
+		config, _, err := image.DecodeConfig(bytes.NewReader(data))
+		if err != nil {
+			t.Fatalf("%s: %v", file, err)
+		}
+
+		result := <-ParseSudokuAsync(data)
+		if result.Err != nil && result.Err != ErrNoGrid {
+			continue
+		}
+		if result.Memory.PeakBytes <= 0 {
+			t.Errorf("%s: no memory recorded", file)
+		} else if budget := memoryBudget(config); result.Memory.PeakBytes > budget {
+			t.Errorf("%s: peak of %d bytes exceeds budget of %d for %dx%d", file, result.Memory.PeakBytes,
+				budget, config.Width, config.Height)
+		}
+	}
+
+	if totals := CurrentMemoryTotals(); totals.PeakParseBytes <= 0 || totals.PeakLiveBytes < totals.PeakParseBytes {
+		t.Errorf("unexpected memory totals %+v", totals)
+	}
+}
+
+func TestParsePipeline(t *testing.T) {
+	data, err := ioutil.ReadFile(sample800wiFile)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	ConfigurePipeline(&PipelineConfig{DetectThreads: 2, MaxBatch: 4})
+	defer ConfigurePipeline(nil)
+
+	// boards are classified in batches across consecutive images
+	results := []<-chan ParseResult{}
+	for i := 0; i < 16; i++ {
+		results = append(results, ParseSudokuAsync(data))
+	}
+	for _, done := range results {
+		if result := <-done; result.Err != nil || result.Puzzle != sample800wi {
+			t.Errorf("pipelined parse returned %q, %v", result.Puzzle, result.Err)
+		}
+	}
+}
+
+func TestReloadModelUnderLoad(t *testing.T) {
+	data, err := ioutil.ReadFile(sample800wiFile)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	results := []<-chan ParseResult{}
+	for i := 0; i < 16; i++ {
+		results = append(results, ParseSudokuAsync(data))
+	}
+
+	// publish the same model again while those parses are in flight
+	before := ModelGeneration()
+	generation, err := ReloadModel("")
+	if err != nil || generation <= before {
+		t.Fatalf("reload returned generation %d after %d: %v", generation, before, err)
+	}
+	if _, err := ReloadModel("missing_model.yml"); err == nil || ModelGeneration() != generation {
+		t.Errorf("failed reload replaced the published model")
+	}
+
+	for i := 0; i < 16; i++ {
+		results = append(results, ParseSudokuAsync(data))
+	}
+	for _, done := range results {
+		if result := <-done; result.Err != nil || result.Puzzle != sample800wi {
+			t.Errorf("parse across reload returned %q, %v", result.Puzzle, result.Err)
+		}
+	}
+}
+
+func TestParseSudokuWithCorners(t *testing.T) {
+	data, err := ioutil.ReadFile(sample800wiFile)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	detected := <-ParseSudokuAsync(data)
+	if detected.Err != nil || len(detected.Points) != 4 {
+		t.Fatalf("grid not detected in %s: %v", sample800wiFile, detected.Err)
+	}
+
+	// re-parsing from the detected corners skips grid detection but finds the same puzzle
+	reparsed := <-ParseSudokuWithCornersAsync(data, detected.Points)
+	if reparsed.Err != nil || reparsed.Puzzle != sample800wi {
+		t.Errorf("%s re-parsed from corners as %s: %v", sample800wiFile, reparsed.Puzzle, reparsed.Err)
+	}
+	for i, point := range reparsed.Points {
+		if point != detected.Points[i] {
+			t.Errorf("corner %d moved from %v to %v", i, detected.Points[i], point)
+		}
+	}
+}
+
+// noGridBudget bounds how long rejecting an image without a grid may take, well under a full parse
+const noGridBudget = 20 * time.Millisecond
+
+func encodePNG(t *testing.T, img image.Image) []byte {
+	var encoded bytes.Buffer
+	if err := png.Encode(&encoded, img); err != nil {
+		t.Fatal(err)
+	}
+	return encoded.Bytes()
+}
+
+// speckledImage stands in for a photo: overlapping discs of random shade whose edges run every which way
+func speckledImage(width, height int) *image.Gray {
+	random := rand.New(rand.NewSource(1))
+	speckled := image.NewGray(image.Rect(0, 0, width, height))
+	for i := range speckled.Pix {
+		speckled.Pix[i] = 200
+	}
+	for disc := 0; disc < 400; disc++ {
+		cx, cy, r := random.Intn(width), random.Intn(height), 4+random.Intn(30)
+		shade := uint8(random.Intn(256))
+		for y := cy - r; y <= cy+r; y++ {
+			for x := cx - r; x <= cx+r; x++ {
+				if (x-cx)*(x-cx)+(y-cy)*(y-cy) <= r*r && image.Pt(x, y).In(speckled.Rect) {
+					speckled.SetGray(x, y, color.Gray{Y: shade})
+				}
+			}
+		}
+	}
+	return speckled
+}
+
+func TestParseSudokuNoGrid(t *testing.T) {
+	// a blank image has no edges at all and a speckled one has edges in no particular orientation
+	blank := image.NewGray(image.Rect(0, 0, 640, 480))
+	for i := range blank.Pix {
+		blank.Pix[i] = 255
+	}
+	images := map[string][]byte{
+		"blank":    encodePNG(t, blank),
+		"speckled": encodePNG(t, speckledImage(640, 480)),
+	}
+
+	for name, data := range images {
+		// take the fastest of a few rejections so a busy machine doesn't fail the budget
+		fastest := time.Duration(math.MaxInt64)
+		for i := 0; i < 5; i++ {
+			start := time.Now()
+			result := <-ParseSudokuAsync(data)
+			if elapsed := time.Since(start); elapsed < fastest {
+				fastest = elapsed
+			}
+			if result.Err != ErrNoGrid {
+				t.Errorf("%s image parsed with error %v rather than ErrNoGrid", name, result.Err)
+				break
+			}
+		}
+		if fastest > noGridBudget {
+			t.Errorf("%s image took %v to reject, more than %v", name, fastest, noGridBudget)
+		}
+		t.Logf("rejected %s image in %v", name, fastest)
+	}
+}
+
+func TestParseSudokuGridCheck(t *testing.T) {
+	// the no-grid check must never turn away a puzzle the parser can read
+	for _, sample := range loadCorpus(t) {
+		if result := <-ParseSudokuAsync(sample.data); result.Err == ErrNoGrid {
+			t.Errorf("%s rejected as having no grid", sample.file)
+		}
+	}
+}
+
+func TestParseSudokuPage(t *testing.T) {
+	data, err := ioutil.ReadFile(sample800wiFile)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	// a page holding a single puzzle yields that puzzle among its grids
+	results := ParseSudokuPage(data)
+	for _, result := range results {
+		if result.Err == nil && result.Puzzle == sample800wi && len(result.Points) == 4 {
+			return
+		}
+	}
+	t.Errorf("%s not found among %d page grids", sample800wiFile, len(results))
+}
+
+// BenchmarkCascadeThreshold reports accuracy and the share of cells accepted by the fast
+// path across the labeled corpus for a range of cascade thresholds
+func BenchmarkCascadeThreshold(b *testing.B) {
+	corpus := loadCorpus(b)
+
+	defer SetCascadeThreshold(DefaultCascadeThreshold)
+
+	for _, threshold := range []float64{0, 0.7, 0.85, 0.95, 1} {
+		b.Run(fmt.Sprintf("threshold=%.2f", threshold), func(b *testing.B) {
+			SetCascadeThreshold(threshold)
+			correct, digits, fast := 0, 0, 0
+			for n := 0; n < b.N; n++ {
+				for _, sample := range corpus {
+					parsed, _, details, _ := ParseSudokuDetailsFromByteArray(sample.data)
+					for c := range details {
+						if sample.puzzle[c] == '.' || c >= len(parsed) {
+							continue
+						}
+						digits++
+						if parsed[c] == sample.puzzle[c] {
+							correct++
+						}
+						if details[c].Stage == StageFast {
+							fast++
+						}
+					}
+				}
+			}
+			if digits > 0 {
+				b.ReportMetric(100*float64(correct)/float64(digits), "%accuracy")
+				b.ReportMetric(100*float64(fast)/float64(digits), "%fast")
+			}
+		})
+	}
+}
+
+// BenchmarkClassifierBackends reports per-image latency and digit accuracy of each classifier
+// backend over the labeled corpus.  The cnn backend runs when GO_SUDOKU_CNN_MODEL names an ONNX model
+// and the linear and centroid backends once TrainSudoku has written their models
+func BenchmarkClassifierBackends(b *testing.B) {
+	corpus := loadCorpus(b)
+
+	backends := []string{BackendSVM, BackendCNN, BackendLinear, BackendLinear + "-int16", BackendLinear + "-int8",
+		BackendCentroid, BackendCentroid + "-int8"}
+	for _, backend := range backends {
+		b.Run(backend, func(b *testing.B) {
+			if backend == BackendCNN && os.Getenv("GO_SUDOKU_CNN_MODEL") == "" {
+				b.Skip("GO_SUDOKU_CNN_MODEL not set; the cnn backend also needs -tags dnn and OpenCV 3.4.3 or newer")
+			}
+			context, err := NewContext(backend, "", -1)
+			if err != nil && backend != BackendSVM {
+				// linear and centroid models only exist once TrainSudoku has run
+				b.Skip(err)
+			} else if err != nil {
+				b.Fatal(err)
+			}
+			defer context.Close()
+
+			correct, digits := 0, 0
+			b.ResetTimer()
+			for n := 0; n < b.N; n++ {
+				for _, sample := range corpus {
+					result := <-context.ParseSudokuAsync(sample.data)
+					if result.Err != nil {
+						b.Fatal(result.Err)
+					}
+					for c := range result.Puzzle {
+						if sample.puzzle[c] == '.' {
+							continue
+						}
+						digits++
+						if result.Puzzle[c] == sample.puzzle[c] {
+							correct++
+						}
+					}
+				}
+			}
+			b.ReportMetric(float64(b.Elapsed().Microseconds())/float64(b.N*len(corpus)), "us/image")
+			if digits > 0 {
+				b.ReportMetric(100*float64(correct)/float64(digits), "%accuracy")
+			}
+		})
+	}
+}
+
+// BenchmarkThreadingPolicy reports corpus throughput with every image in flight at once
+// under each threading policy, with and without workers pinned to cores
+func BenchmarkThreadingPolicy(b *testing.B) {
+	corpus := loadCorpus(b)
+
+	policies := []struct {
+		name   string
+		policy ThreadingPolicy
+		pin    bool
+	}{
+		{"default", ThreadingDefault, false},
+		{"intra", ThreadingIntraImage, false},
+		{"inter", ThreadingInterImage, false},
+		{"inter-pinned", ThreadingInterImage, true},
+	}
+	defer ConfigureThreading(ThreadingDefault, false)
+
+	for _, p := range policies {
+		b.Run(p.name, func(b *testing.B) {
+			ConfigureThreading(p.policy, p.pin)
+			b.ResetTimer()
+			for n := 0; n < b.N; n++ {
+				results := make([]<-chan ParseResult, len(corpus))
+				for i, sample := range corpus {
+					results[i] = ParseSudokuAsync(sample.data)
+				}
+				for _, result := range results {
+					<-result
+				}
+			}
+			b.ReportMetric(float64(b.N*len(corpus))/b.Elapsed().Seconds(), "images/s")
+		})
+	}
+}
+
+func BenchmarkParsePipeline(b *testing.B) {
+	corpus := loadCorpus(b)
+
+	configs := []struct {
+		name   string
+		config *PipelineConfig
+	}{
+		{"executor", nil},
+		{"pipeline-default", &PipelineConfig{}},
+		{"pipeline-batch1", &PipelineConfig{MaxBatch: 1}},
+		{"pipeline-2-detect", &PipelineConfig{DetectThreads: 2}},
+	}
+	defer ConfigurePipeline(nil)
+
+	for _, c := range configs {
+		b.Run(c.name, func(b *testing.B) {
+			ConfigurePipeline(c.config)
+			b.ResetTimer()
+			maxDepth := 0
+			for n := 0; n < b.N; n++ {
+				results := make([]<-chan ParseResult, len(corpus))
+				for i, sample := range corpus {
+					results[i] = ParseSudokuAsync(sample.data)
+				}
+				depths := CurrentPipelineDepths()
+				if depth := depths.Decode + depths.Detect + depths.Classify; depth > maxDepth {
+					maxDepth = depth
+				}
+				for _, result := range results {
+					<-result
+				}
+			}
+			b.ReportMetric(float64(b.N*len(corpus))/b.Elapsed().Seconds(), "images/s")
+			b.ReportMetric(float64(maxDepth), "max-queued")
+		})
+	}
+}
+
 func TestTrainSudoku(t *testing.T) {
 	if sudokuString := TrainSudoku("train_config.csv"); sudokuString != "97.73" {
 		t.Error("Unexpected response from training Sudoku: " + sudokuString)